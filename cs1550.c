@@ -7,76 +7,658 @@
 */
 
 #define    FUSE_USE_VERSION 26
+#define _GNU_SOURCE    //for fopencookie
 
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cs1550.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+//mount options, filled in from -o by main()
+static struct cs1550_options {
+    int compress;    //store data blocks compressed when it saves space
+    unsigned int defrag_rate;    //blocks per second the defragmenter may move, 0 is off
+    char *images;    //colon separated image files to stripe over, .disk if not given
+    unsigned int stripe;    //blocks per stripe unit, DEFAULT_STRIPE if not given
+    int direct;    //open the images O_DIRECT and cache blocks ourselves
+    unsigned int cache_pages;    //size of that cache in CACHE_PAGE pages, DEFAULT_CACHE_PAGES if not given
+} options;
+
+static struct cs1550_superblock super;
+
+//Every request runs out of per-thread state that's built the first time a
+//thread serves one and then reused: the disk handle, a bump allocator for the
+//request's scratch structures, and a pool of recycled block buffers. After a
+//thread's first few requests the request path does no heap allocation.
+//thread_key's destructor releases it all when libfuse retires the thread.
+
+#define ARENA_SIZE (8 * BLOCK_SIZE)
+#define ARENA_HEADER 16    //room for a struct cs1550_arena_chunk at the front of each arena
+#define POOL_BLOCKS 16
+#define BUFFER_ALIGN 4096
+
+struct cs1550_arena_chunk {
+    struct cs1550_arena_chunk *next;
+    size_t size;
+};
 
-//size of a disk block
-#define    BLOCK_SIZE 512
+struct cs1550_thread {
+    FILE *disk;                             //open for the thread's lifetime
+    off_t disk_pos;                         //where the disk stream is on the volume
+    char disk_buffer[BLOCK_SIZE];           //the disk stream's stdio buffer
+    char *arena;                            //scratch for the request being served
+    size_t arena_used;
+    size_t arena_size;
+    struct cs1550_arena_chunk *retired;     //outgrown arenas, freed at the next reset
+    void *pool[POOL_BLOCKS];                //recycled block buffers
+    int pool_free;
+    long root;                              //root directory block paths resolve against
+};
 
-//we'll use 8.3 filenames
-#define    MAX_FILENAME 8
-#define    MAX_EXTENSION 3
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+//what the per-thread state holds across all threads, for user.cs1550.memory
+static long memory_threads = 0;
+static long memory_arena_bytes = 0;
+static long memory_pool_blocks = 0;
+static long memory_cache_pages = 0;
+static long cache_hits = 0;
+static long cache_misses = 0;
+
+static void freeRetired(struct cs1550_thread *state) {
+    while (state->retired) {
+        struct cs1550_arena_chunk *next = state->retired->next;
+        __atomic_sub_fetch(&memory_arena_bytes, state->retired->size, __ATOMIC_RELAXED);
+        free(state->retired);
+        state->retired = next;
+    }
+}
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+static void releaseThread(void *arg) {
+    struct cs1550_thread *state = arg;
+    if (state->disk) {
+        fclose(state->disk);
+    }
+    freeRetired(state);
+    free(state->arena);
+    __atomic_sub_fetch(&memory_arena_bytes, state->arena_size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory_pool_blocks, state->pool_free, __ATOMIC_RELAXED);
+    while (state->pool_free > 0) {
+        free(state->pool[--state->pool_free]);
+    }
+    __atomic_sub_fetch(&memory_threads, 1, __ATOMIC_RELAXED);
+    free(state);
+}
 
-//The attribute packed means to not align these things
-struct cs1550_directory_entry {
-    int nFiles;    //How many files are in this directory.
-    //Needs to be less than MAX_FILES_IN_DIR
+static void createThreadKey(void) {
+    pthread_key_create(&thread_key, releaseThread);
+}
 
-    struct cs1550_file_directory {
-        char fname[MAX_FILENAME + 1];    //filename (plus space for nul)
-        char fext[MAX_EXTENSION + 1];    //extension (plus space for nul)
-        size_t fsize;                    //file size
-        long nStartBlock;                //where the first block is on disk
-    } __attribute__((packed)) files[MAX_FILES_IN_DIR];    //There is an array of these
+static struct cs1550_thread *threadState(void) {
+    pthread_once(&thread_key_once, createThreadKey);
+    struct cs1550_thread *state = pthread_getspecific(thread_key);
+    if (!state) {
+        state = calloc(1, sizeof(struct cs1550_thread));
+        if (!state) {
+            return NULL;
+        }
+        state->arena = malloc(ARENA_SIZE);
+        if (!state->arena) {
+            free(state);
+            return NULL;
+        }
+        state->arena_size = ARENA_SIZE;
+        state->arena_used = ARENA_HEADER;
+        pthread_setspecific(thread_key, state);
+        __atomic_add_fetch(&memory_arena_bytes, ARENA_SIZE, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&memory_threads, 1, __ATOMIC_RELAXED);
+    }
+    return state;
+}
 
-    //This is some space to get this to be exactly the size of the disk block.
-    //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
-};
+/*
+ * Hands out scratch memory that lives until the thread's next request. If a
+ * request outgrows the arena a bigger one replaces it, so the next request
+ * fits without allocating. NULL if there's no memory for that.
+ */
+void *arenaAlloc(size_t size) {
+    struct cs1550_thread *state = threadState();
+    if (!state) {
+        return NULL;
+    }
+    size = (size + 15) & ~(size_t) 15;
+    if (state->arena_used + size > state->arena_size) {
+        size_t grown = state->arena_size * 2;
+        while (grown < ARENA_HEADER + size) {
+            grown *= 2;
+        }
+        char *arena = malloc(grown);
+        if (!arena) {
+            return NULL;
+        }
+        struct cs1550_arena_chunk *old = (struct cs1550_arena_chunk *) state->arena;
+        old->next = state->retired;
+        old->size = state->arena_size;
+        state->retired = old;
+        __atomic_add_fetch(&memory_arena_bytes, grown, __ATOMIC_RELAXED);
+        state->arena = arena;
+        state->arena_size = grown;
+        state->arena_used = ARENA_HEADER;
+    }
+    void *memory = state->arena + state->arena_used;
+    state->arena_used += size;
+    return memory;
+}
+
+//called at the start of every request, which also starts out on the live root;
+//-ENOMEM if the thread's state can't be built
+int arenaReset(void) {
+    struct cs1550_thread *state = threadState();
+    if (!state) {
+        return -ENOMEM;
+    }
+    freeRetired(state);
+    state->arena_used = ARENA_HEADER;
+    state->root = 0;
+    return 0;
+}
 
-typedef struct cs1550_root_directory cs1550_root_directory;
+//block 0 normally, the snapshot's copy of the root while reading inside one
+long rootBlock(void) {
+    struct cs1550_thread *state = threadState();
+    return state ? state->root : 0;
+}
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+/*
+ * Block buffers aligned to BUFFER_ALIGN, recycled through a per-thread pool
+ */
+struct cs1550_disk_block *getBlock(void) {
+    struct cs1550_thread *state = threadState();
+    if (state && state->pool_free > 0) {
+        return state->pool[--state->pool_free];
+    }
+    void *block;
+    if (posix_memalign(&block, BUFFER_ALIGN, sizeof(struct cs1550_disk_block))) {
+        return NULL;
+    }
+    __atomic_add_fetch(&memory_pool_blocks, 1, __ATOMIC_RELAXED);
+    return block;
+}
 
-struct cs1550_root_directory {
-    int nDirectories;    //How many subdirectories are in the root
-    //Needs to be less than MAX_DIRS_IN_ROOT
-    struct cs1550_directory {
-        char dname[MAX_FILENAME + 1];    //directory name (plus space for nul)
-        long nStartBlock;                //where the directory block is on disk
-    } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];    //There is an array of these
+void putBlock(struct cs1550_disk_block *block) {
+    struct cs1550_thread *state = threadState();
+    if (state && state->pool_free < POOL_BLOCKS) {
+        state->pool[state->pool_free++] = block;
+    } else {
+        free(block);
+        __atomic_sub_fetch(&memory_pool_blocks, 1, __ATOMIC_RELAXED);
+    }
+}
 
-    //This is some space to get this to be exactly the size of the disk block.
-    //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+//The image files behind the volume, opened by main() before mounting. With
+//one member this is just .disk; with several, blocks are striped over them
+//as cs1550.h lays out.
+static struct cs1550_volume {
+    int members;
+    int fd[MAX_MEMBERS];
+    int stripe;
+    off_t size;
+} volume;
+
+//With -o direct the images are opened O_DIRECT, so the host page cache no
+//longer holds a second copy of what the kernel's FUSE cache already has.
+//Instead a fixed number of aligned pages are cached here, split evenly into
+//one shard per member so the threads of a striped transfer never wait on
+//each other. Writes go through to the image straight away.
+#define CACHE_PAGE BUFFER_ALIGN
+#define DEFAULT_CACHE_PAGES 256
+
+struct cs1550_cache_page {
+    off_t page;    //member offset / CACHE_PAGE, -1 if the slot is empty
+    int referenced;    //for the clock sweep
+    int next;    //next slot in the same hash bucket, -1 at the end
+    char *data;
 };
 
+static struct cs1550_cache {
+    pthread_mutex_t lock;
+    struct cs1550_cache_page *pages;
+    int *buckets;
+    int count;
+    int hand;
+} cache[MAX_MEMBERS];
+
+int createCache(int members, unsigned int pages) {
+    int per_member = pages / members > 0 ? pages / members : 1;
+    int m, i;
+    for (m = 0; m < members; m++) {
+        struct cs1550_cache *shard = &cache[m];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->pages = calloc(per_member, sizeof(struct cs1550_cache_page));
+        shard->buckets = malloc(per_member * sizeof(int));
+        if (!shard->pages || !shard->buckets) {
+            return -1;
+        }
+        shard->count = per_member;
+        for (i = 0; i < per_member; i++) {
+            shard->buckets[i] = -1;
+            shard->pages[i].page = -1;
+            shard->pages[i].next = -1;
+            if (posix_memalign((void **) &shard->pages[i].data, BUFFER_ALIGN, CACHE_PAGE)) {
+                return -1;
+            }
+        }
+        memory_cache_pages += per_member;
+    }
+    return 0;
+}
+
+static void cacheUnlink(struct cs1550_cache *shard, int slot) {
+    int *link = &shard->buckets[shard->pages[slot].page % shard->count];
+    while (*link != slot) {
+        link = &shard->pages[*link].next;
+    }
+    *link = shard->pages[slot].next;
+    shard->pages[slot].page = -1;
+}
+
+/*
+ * Finds page of member in its shard, taking over a slot the clock sweep
+ * picks if it isn't there. The page is read in unless load is 0, for a
+ * caller about to overwrite all of it. Called with the shard locked.
+ */
+static struct cs1550_cache_page *cacheLookup(int member, off_t page, int load) {
+    struct cs1550_cache *shard = &cache[member];
+    int slot;
+    for (slot = shard->buckets[page % shard->count]; slot != -1; slot = shard->pages[slot].next) {
+        if (shard->pages[slot].page == page) {
+            shard->pages[slot].referenced = 1;
+            __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+            return &shard->pages[slot];
+        }
+    }
+    __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
 
-typedef struct cs1550_directory_entry cs1550_directory_entry;
+    while (shard->pages[shard->hand].referenced) {
+        shard->pages[shard->hand].referenced = 0;
+        shard->hand = (shard->hand + 1) % shard->count;
+    }
+    slot = shard->hand;
+    shard->hand = (shard->hand + 1) % shard->count;
+    struct cs1550_cache_page *entry = &shard->pages[slot];
+    if (entry->page != -1) {
+        cacheUnlink(shard, slot);
+    }
+    if (load && pread(volume.fd[member], entry->data, CACHE_PAGE, page * CACHE_PAGE) != CACHE_PAGE) {
+        return NULL;
+    }
+    entry->page = page;
+    entry->referenced = 1;
+    entry->next = shard->buckets[page % shard->count];
+    shard->buckets[page % shard->count] = slot;
+    return entry;
+}
 
-//How much data can one block hold?
-#define    MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+//moves length bytes at member_pos of member through its shard of the cache
+static int cacheTransfer(int member, char *buf, size_t length, off_t member_pos, int write) {
+    struct cs1550_cache *shard = &cache[member];
+    int res = 0;
+    pthread_mutex_lock(&shard->lock);
+    while (length > 0) {
+        off_t page = member_pos / CACHE_PAGE;
+        size_t within = member_pos % CACHE_PAGE;
+        size_t piece = CACHE_PAGE - within;
+        if (piece > length) {
+            piece = length;
+        }
+        struct cs1550_cache_page *entry = cacheLookup(member, page, !write || piece < CACHE_PAGE);
+        if (!entry) {
+            res = -1;
+            break;
+        }
+        if (write) {
+            memcpy(entry->data + within, buf, piece);
+            if (pwrite(volume.fd[member], entry->data, CACHE_PAGE, page * CACHE_PAGE) != CACHE_PAGE) {
+                cacheUnlink(shard, entry - shard->pages);
+                res = -1;
+                break;
+            }
+        } else {
+            memcpy(buf, entry->data + within, piece);
+        }
+        buf += piece;
+        member_pos += piece;
+        length -= piece;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
 
-struct cs1550_disk_block {
-    //All of the space in the block can be used for actual data
-    //storage.
-    char data[MAX_DATA_IN_BLOCK];
+struct cs1550_member_io {
+    char *buf;
+    size_t size;
+    off_t pos;
+    int member;
+    int write;
+    int error;
+    int done;    //set by the member's worker once it's moved everything
+    struct cs1550_member_io *next;    //in the worker's queue
 };
 
-typedef struct cs1550_disk_block cs1550_disk_block;
+//With several members each gets a thread for the life of the mount that
+//moves its part of other threads' transfers, so a transfer costs a queue
+//push rather than a thread.
+static struct cs1550_worker {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct cs1550_member_io *queue;
+    int running;
+} workers[MAX_MEMBERS];
+
+//moves the stripe units of [pos, pos + size) that live on io->member
+static void memberTransfer(struct cs1550_member_io *io) {
+    size_t done = 0;
+    while (done < io->size) {
+        int member;
+        off_t member_pos;
+        size_t length = stripeLocate(io->pos + done, volume.members, volume.stripe, &member, &member_pos);
+        if (length > io->size - done) {
+            length = io->size - done;
+        }
+        if (member == io->member && options.direct) {
+            if (cacheTransfer(member, io->buf + done, length, member_pos, io->write)) {
+                io->error = 1;
+                return;
+            }
+        } else if (member == io->member) {
+            size_t moved = 0;
+            while (moved < length) {
+                ssize_t res;
+                if (io->write) {
+                    res = pwrite(volume.fd[member], io->buf + done + moved, length - moved, member_pos + moved);
+                } else {
+                    res = pread(volume.fd[member], io->buf + done + moved, length - moved, member_pos + moved);
+                }
+                if (res <= 0) {
+                    io->error = 1;
+                    return;
+                }
+                moved += res;
+            }
+        }
+        done += length;
+    }
+}
+
+static void *memberWorker(void *arg) {
+    struct cs1550_worker *worker = arg;
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        while (!worker->queue) {
+            pthread_cond_wait(&worker->work, &worker->lock);
+        }
+        struct cs1550_member_io *io = worker->queue;
+        worker->queue = io->next;
+        pthread_mutex_unlock(&worker->lock);
+        memberTransfer(io);
+        pthread_mutex_lock(&worker->lock);
+        io->done = 1;
+        pthread_cond_broadcast(&worker->done);
+    }
+    return NULL;
+}
 
-#define MAX_FAT (BLOCK_SIZE/sizeof(short))
+//starts a worker per member, any that can't start leave their member's
+//transfers to the caller. Called from init, since threads started before
+//libfuse forks into the background don't survive it.
+static void startWorkers(int members) {
+    int m;
+    for (m = 0; m < members; m++) {
+        struct cs1550_worker *worker = &workers[m];
+        pthread_t thread;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->work, NULL);
+        pthread_cond_init(&worker->done, NULL);
+        worker->running = !pthread_create(&thread, NULL, memberWorker, worker);
+        if (worker->running) {
+            pthread_detach(thread);
+        }
+    }
+}
 
-struct cs_1550_fat {
-    short table[MAX_FAT];
-};
+/*
+ * Reads or writes size bytes of the volume at pos. A transfer that spans
+ * several members hands all but the first to their workers and moves the
+ * first itself, so all the images are busy at once.
+ */
+int volumeTransfer(char *buf, size_t size, off_t pos, int write) {
+    struct cs1550_member_io io[MAX_MEMBERS];
+    int member;
+    off_t member_pos;
+    size_t first = stripeLocate(pos, volume.members, volume.stripe, &member, &member_pos);
+
+    int touched = 1;
+    if (size > first) {
+        size_t unit_size = (size_t) volume.stripe * BLOCK_SIZE;
+        size_t units = 1 + (size - first + unit_size - 1) / unit_size;
+        touched = units < (size_t) volume.members ? (int) units : volume.members;
+    }
+    int i, error = 0;
+    for (i = 0; i < touched; i++) {
+        io[i].buf = buf;
+        io[i].size = size;
+        io[i].pos = pos;
+        io[i].member = (member + i) % volume.members;
+        io[i].write = write;
+        io[i].error = 0;
+        io[i].done = 0;
+    }
+    for (i = 1; i < touched; i++) {
+        struct cs1550_worker *worker = &workers[io[i].member];
+        if (worker->running) {
+            pthread_mutex_lock(&worker->lock);
+            io[i].next = worker->queue;
+            worker->queue = &io[i];
+            pthread_cond_signal(&worker->work);
+            pthread_mutex_unlock(&worker->lock);
+        } else {
+            memberTransfer(&io[i]);
+            io[i].done = 1;
+        }
+    }
+    memberTransfer(&io[0]);
+    error |= io[0].error;
+    for (i = 1; i < touched; i++) {
+        struct cs1550_worker *worker = &workers[io[i].member];
+        if (worker->running) {
+            pthread_mutex_lock(&worker->lock);
+            while (!io[i].done) {
+                pthread_cond_wait(&worker->done, &worker->lock);
+            }
+            pthread_mutex_unlock(&worker->lock);
+        }
+        error |= io[i].error;
+    }
+    return error ? -1 : 0;
+}
+
+//where a byte of the volume lives, for handing libfuse an fd and offset
+size_t volumeLocate(off_t pos, int *fd, off_t *member_pos) {
+    int member;
+    size_t length = stripeLocate(pos, volume.members, volume.stripe, &member, member_pos);
+    *fd = volume.fd[member];
+    return length;
+}
+
+/*
+ * Opens the images named in images (colon separated, .disk if NULL) and
+ * checks them against the geometry the superblock recorded, if any. With
+ * direct they're opened O_DIRECT and the cache is set up in front of them.
+ */
+int openVolume(const char *images, unsigned int stripe, int direct) {
+    char *names = strdup(images ? images : ".disk");
+    char *name, *rest = names;
+    off_t member_size = -1;
+    if (!names) {
+        return -1;
+    }
+
+    volume.stripe = stripe ? stripe : DEFAULT_STRIPE;
+    while ((name = strsep(&rest, ":"))) {
+        struct stat st;
+        if (volume.members == MAX_MEMBERS) {
+            printf("\ncan't stripe over more than %d images\n", MAX_MEMBERS);
+            free(names);
+            return -1;
+        }
+        int fd = open(name, direct ? O_RDWR | O_DIRECT : O_RDWR);
+        if (fd < 0 || fstat(fd, &st)) {
+            printf("\nerror opening %s\n", name);
+            free(names);
+            return -1;
+        }
+        //O_DIRECT only moves whole aligned pages, the last one included
+        if (direct && st.st_size % CACHE_PAGE) {
+            printf("\n%s isn't a whole number of %d byte pages\n", name, CACHE_PAGE);
+            free(names);
+            return -1;
+        }
+        volume.fd[volume.members++] = fd;
+        if (member_size == -1 || st.st_size < member_size) {
+            member_size = st.st_size;
+        }
+    }
+    free(names);
+    volume.size = stripedSize(member_size, volume.members, volume.stripe);
+    if (direct && createCache(volume.members, options.cache_pages ? options.cache_pages : DEFAULT_CACHE_PAGES)) {
+        printf("\nno memory for the block cache\n");
+        return -1;
+    }
+
+    struct cs1550_superblock sb;
+    if (volume.size < -SUPERBLOCK_OFFSET ||
+        volumeTransfer((char *) &sb, sizeof(struct cs1550_superblock), volume.size + SUPERBLOCK_OFFSET, 0)) {
+        printf("\nvolume too small to hold a filesystem\n");
+        return -1;
+    }
+    if (sb.magic == CS1550_MAGIC && sb.members &&
+        (sb.members != volume.members || (sb.members > 1 && sb.stripe != volume.stripe))) {
+        printf("\nvolume was made over %d images with %d block stripes\n", sb.members, sb.stripe);
+        return -1;
+    }
+    return 0;
+}
+
+//stdio callbacks that make a thread's disk stream read and write the volume
+static ssize_t diskRead(void *cookie, char *buf, size_t size) {
+    struct cs1550_thread *state = cookie;
+    if (state->disk_pos >= volume.size) {
+        return 0;
+    }
+    if ((off_t) size > volume.size - state->disk_pos) {
+        size = volume.size - state->disk_pos;
+    }
+    if (volumeTransfer(buf, size, state->disk_pos, 0)) {
+        return -1;
+    }
+    state->disk_pos += size;
+    return size;
+}
+
+static ssize_t diskWrite(void *cookie, const char *buf, size_t size) {
+    struct cs1550_thread *state = cookie;
+    if (state->disk_pos >= volume.size) {
+        return 0;
+    }
+    if ((off_t) size > volume.size - state->disk_pos) {
+        size = volume.size - state->disk_pos;
+    }
+    if (volumeTransfer((char *) buf, size, state->disk_pos, 1)) {
+        return 0;
+    }
+    state->disk_pos += size;
+    return size;
+}
+
+static int diskSeek(void *cookie, off64_t *offset, int whence) {
+    struct cs1550_thread *state = cookie;
+    off_t pos = *offset;
+    if (whence == SEEK_CUR) {
+        pos += state->disk_pos;
+    } else if (whence == SEEK_END) {
+        pos += volume.size;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    state->disk_pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+/*
+ * Returns this thread's stream over the volume, positioned at the start like
+ * a fresh fopen of .disk. Offsets on it are volume offsets; striping happens
+ * underneath. It buffers a single block, since stdio reads an unbuffered
+ * custom stream a byte at a time. Metadata-sized writes of whole blocks
+ * still go straight through, and the rewind drops anything read ahead, so
+ * no thread sees a stale copy of another's writes.
+ */
+FILE *openDisk(void) {
+    struct cs1550_thread *state = threadState();
+    if (!state || volume.members == 0) {
+        return NULL;
+    }
+    if (!state->disk) {
+        cookie_io_functions_t io = {diskRead, diskWrite, diskSeek, NULL};
+        state->disk_pos = 0;
+        state->disk = fopencookie(state, "r+", io);
+        if (state->disk) {
+            setvbuf(state->disk, state->disk_buffer, _IOFBF, BLOCK_SIZE);
+        }
+    } else {
+        rewind(state->disk);
+    }
+    return state->disk;
+}
+
+//the handle stays open for the thread's next request, with nothing left
+//in its buffer
+void closeDisk(FILE *file) {
+    if (file) {
+        fflush(file);
+        clearerr(file);
+    }
+}
+
+//gets everything written through file onto every image's storage, for
+//updates that must reach the disk in a given order
+int syncVolume(FILE *file) {
+    int res = fflush(file) ? -1 : 0;
+    int m;
+    for (m = 0; m < volume.members; m++) {
+        if (fsync(volume.fd[m])) {
+            res = -1;
+        }
+    }
+    return res;
+}
 
 void format(const char *path, char *directory, char *filename, char *extension) {
     directory[0] = '\0'; //put terminators before and after string in char array
@@ -98,16 +680,19 @@ void format(const char *path, char *directory, char *filename, char *extension)
 int findDirectory(char *directory, struct cs1550_directory_entry *entry) {
     FILE *file;
     int location = -1;
-    file = fopen(".disk", "rb");
+    file = openDisk();
 
     if (!file) {
         printf("\n.disk error\n");
     } else {
-        struct cs1550_root_directory *root = malloc(sizeof(struct cs1550_root_directory));
+        //the root is read into entry's block, which the directory's entry
+        //then overwrites, so looking a directory up never allocates
+        struct cs1550_root_directory *root = (struct cs1550_root_directory *) entry;
 
-        if (!fread(root, sizeof(struct cs1550_root_directory), 1, file)) {
+        if (fseek(file, rootBlock() * BLOCK_SIZE, SEEK_SET) ||
+            !fread(root, sizeof(struct cs1550_root_directory), 1, file)) {
             printf("\n.disk error\n");
-            fclose(file);
+            closeDisk(file);
             return -1;
         }
         int i;
@@ -117,12 +702,12 @@ int findDirectory(char *directory, struct cs1550_directory_entry *entry) {
                 int offset = location * BLOCK_SIZE;
                 if (fseek(file, offset, SEEK_SET)) {
                     printf("\n.disk error\n");
-                    fclose(file);
+                    closeDisk(file);
                     location = -1;
                 } else {
                     if (!fread(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
                         printf("\n.disk error\n");
-                        fclose(file);
+                        closeDisk(file);
                         location = -1;
                     }
                 }
@@ -131,80 +716,488 @@ int findDirectory(char *directory, struct cs1550_directory_entry *entry) {
         }
     }
 
-    fclose(file);
+    closeDisk(file);
     return location;
 }
 
+/*
+ * Returns the index of filename.extension in a directory, or -1
+ */
+int findFile(struct cs1550_directory_entry *entry, char *filename, char *extension) {
+    int i;
+    for (i = 0; i < entry->nFiles; i++) {
+        if (!strcmp(filename, entry->files[i].fname) && !strcmp(extension, entry->files[i].fext)) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 /*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not. 
- *
- * man -s 2 stat will show the fields of a stat structure
+ * Refreshes the free block count from a FAT that's about to be written
  */
-static int cs1550_getattr(const char *path, struct stat *stbuf) {
-    int res = 0;
-    char directory[MAX_FILENAME + 1];
-    char filename[MAX_FILENAME + 1];
-    char extension[MAX_EXTENSION + 1];
+void countFreeBlocks(struct cs_1550_fat *fat) {
+    int i, free_blocks = 0;
+    //a FAT that was never initialised has every block but the root free
+    if (fat->table[0] == 0) {
+        super.free_blocks = MAX_FAT - 1;
+        return;
+    }
+    for (i = 0; i < MAX_FAT; i++) {
+        if (fat->table[i] == (short) -1) {
+            free_blocks++;
+        }
+    }
+    super.free_blocks = free_blocks;
+}
 
+/*
+ * Move a run of plain blocks that sit next to each other on the volume in one
+ * transfer, so a run that crosses stripe units keeps every member busy. Runs
+ * skip the stream's one block buffer, after flushing whatever it holds.
+ */
+int readRun(FILE *file, off_t pos, char *data, size_t size) {
+    if (fflush(file) || volumeTransfer(data, size, pos, 0)) {
+        return -1;
+    }
+    return 0;
+}
 
-    memset(stbuf, 0, sizeof(struct stat));
+int writeRun(FILE *file, off_t pos, const char *data, size_t size) {
+    if (fflush(file) || volumeTransfer((char *) data, size, pos, 1)) {
+        return -1;
+    }
+    return 0;
+}
 
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else {
-        format(path, filename, directory, extension);
-        struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
-        int location = findDirectory(directory, entry);
-        if (location != -1) {
-            if (strlen(filename) == 0) {
-                stbuf->st_mode = S_IFDIR | 0755;
-                stbuf->st_nlink = 2;
-            } else {
-                int i;
-                int valid = 0;
+/*
+ * Loads the per-block tables from the end of .disk. Nearly every request
+ * does this, so they move in one transfer like a run rather than a block at
+ * a time through the stream's buffer.
+ */
+int readTables(FILE *file, struct cs1550_tables *tables) {
+    return readRun(file, volume.size + TABLES_OFFSET, (char *) tables, sizeof(struct cs1550_tables));
+}
 
-                for (i = 0; i < entry->nFiles; i++) {
-                    if (!strcmp(entry->files[i].fname, filename)) {
-                        valid = 1;
-                        break;
-                    }
-                }
+int writeTables(FILE *file, struct cs1550_tables *tables) {
+    if (writeRun(file, volume.size + TABLES_OFFSET, (const char *) tables, sizeof(struct cs1550_tables))) {
+        return -1;
+    }
+    countFreeBlocks(&tables->fat);
+    return 0;
+}
 
-                if (valid) {
-                    //regular file, probably want to be read and write
-                    stbuf->st_mode = S_IFREG | 0666;
-                    stbuf->st_nlink = 1; //file links
-                    stbuf->st_size = entry->files[i].fsize;
-                } else {
-                    res = -ENOENT;
-                }
+/*
+ * Takes the first free FAT slot and marks it as the end of a chain
+ */
+int allocateBlock(struct cs_1550_fat *fat) {
+    int i;
+    for (i = 0; i < MAX_FAT; i++) {
+        if (fat->table[i] == (short) -1) {
+            fat->table[i] = (short) -2;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Finds the first run of count free FAT slots, preferring the one starting
+ * right after hint so a growing file stays contiguous. Returns -1 if there is
+ * no such run.
+ */
+int findFreeRun(struct cs_1550_fat *fat, int hint, int count) {
+    int i, start = -1, length = 0;
+    if (hint >= 0 && hint + count <= MAX_FAT) {
+        for (i = hint; i < hint + count && fat->table[i] == (short) -1; i++);
+        if (i == hint + count) {
+            return hint;
+        }
+    }
+    for (i = 0; i < MAX_FAT; i++) {
+        if (fat->table[i] == (short) -1) {
+            if (length++ == 0) {
+                start = i;
+            }
+            if (length == count) {
+                return start;
             }
         } else {
-            //Else return that path doesn't exist
-            res = -ENOENT;
+            length = 0;
         }
     }
-    return res;
+    return -1;
 }
 
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
+/*
+ * Block codec in the LZ4 block format: a token byte holding the literal and
+ * match lengths, the literals, then a 2-byte little endian back reference.
+ * The last 5 bytes are always literals and the last match starts at least 12
+ * bytes before the end, as the format requires.
  */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                          off_t offset, struct fuse_file_info *fi) {
-    //Since we're building with -Wall (all warnings reported) we need
-    //to "use" every parameter, so let's just cast them to void to
-    //satisfy the compiler
-    (void) offset;
-    (void) fi;
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 8
 
-    char directory[MAX_FILENAME + 1];
-    char filename[MAX_FILENAME + 1];
-    char extension[MAX_EXTENSION + 1];
+static unsigned int lzHash(const unsigned char *p) {
+    unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+    return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static int lzPutLength(unsigned char *out, int op, int length) {
+    while (length >= 255) {
+        out[op++] = 255;
+        length -= 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+//returns the new output position, or -1 if the sequence doesn't fit
+static int lzEmit(unsigned char *out, int op, int capacity, const unsigned char *literals,
+                  int literal_length, int offset, int match_length) {
+    if (op + 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1 > capacity) {
+        return -1;
+    }
+    int token = op++;
+    out[token] = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        op = lzPutLength(out, op, literal_length - 15);
+    }
+    memcpy(&out[op], literals, literal_length);
+    op += literal_length;
+    if (offset == 0) {
+        return op;
+    }
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+    match_length -= LZ_MIN_MATCH;
+    out[token] |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) {
+        op = lzPutLength(out, op, match_length - 15);
+    }
+    return op;
+}
+
+/*
+ * Compresses length bytes of src into dst. Returns the compressed size, or 0
+ * if it wouldn't fit in capacity bytes.
+ */
+int compressBlock(const char *src, int length, char *dst, int capacity) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    short table[1 << LZ_HASH_LOG];
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0xff, sizeof(table));
+    while (ip + 12 <= length) {
+        unsigned int h = lzHash(&in[ip]);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || memcmp(&in[ref], &in[ip], LZ_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+        int match_length = LZ_MIN_MATCH;
+        while (ip + match_length < length - 5 && in[ref + match_length] == in[ip + match_length]) {
+            match_length++;
+        }
+        op = lzEmit(out, op, capacity, &in[anchor], ip - anchor, ip - ref, match_length);
+        if (op < 0) {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+    }
+    op = lzEmit(out, op, capacity, &in[anchor], length - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+/*
+ * Expands a compressed extent into dst. Returns the number of bytes produced,
+ * or -1 if the extent is corrupt.
+ */
+int decompressBlock(const char *src, int length, char *dst, int capacity) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int ip = 0, op = 0, b;
+
+    while (ip < length) {
+        int token = in[ip++];
+        int run = token >> 4;
+        if (run == 15) {
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                b = in[ip++];
+                run += b;
+            } while (b == 255);
+        }
+        if (ip + run > length || op + run > capacity) {
+            return -1;
+        }
+        memcpy(&out[op], &in[ip], run);
+        ip += run;
+        op += run;
+        if (ip == length) {
+            break;
+        }
+
+        if (ip + 2 > length) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+        run = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= length) {
+                    return -1;
+                }
+                b = in[ip++];
+                run += b;
+            } while (b == 255);
+        }
+        if (op + run > capacity) {
+            return -1;
+        }
+        //byte at a time, the reference may overlap what we're writing
+        while (run--) {
+            out[op] = out[op - offset];
+            op++;
+        }
+    }
+    return op;
+}
+
+/*
+ * Reads one data block, filling it with zeros if it was never written and
+ * expanding it if it was stored compressed. Only the stored bytes are read:
+ * a compressed extent is moved as a run, since through the stream's buffer
+ * it would pull in the whole block.
+ */
+int readDataBlock(FILE *file, long block, struct cs1550_tables *tables, char *data) {
+    if (IS_UNWRITTEN(&tables->unwritten, block)) {
+        memset(data, 0, MAX_DATA_IN_BLOCK);
+        return 0;
+    }
+    int stored = tables->extents.length[block];
+    if (stored == 0) {
+        if (fseek(file, block * BLOCK_SIZE, SEEK_SET) || !fread(data, MAX_DATA_IN_BLOCK, 1, file)) {
+            return -1;
+        }
+        return 0;
+    }
+    char extent[BLOCK_SIZE];
+    if (stored >= BLOCK_SIZE || readRun(file, (off_t) block * BLOCK_SIZE, extent, stored)) {
+        return -1;
+    }
+    if (decompressBlock(extent, stored, data, MAX_DATA_IN_BLOCK) != MAX_DATA_IN_BLOCK) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes one data block, compressed if the compress option is on and that
+ * makes it smaller. The caller writes the tables back afterwards.
+ */
+int writeDataBlock(FILE *file, long block, struct cs1550_tables *tables, const char *data) {
+    char extent[BLOCK_SIZE];
+    int stored = 0;
+    if (options.compress) {
+        stored = compressBlock(data, MAX_DATA_IN_BLOCK, extent, BLOCK_SIZE - 1);
+    }
+    if (fseek(file, block * BLOCK_SIZE, SEEK_SET)) {
+        return -1;
+    }
+    if (stored > 0) {
+        if (!fwrite(extent, stored, 1, file)) {
+            return -1;
+        }
+    } else if (!fwrite(data, MAX_DATA_IN_BLOCK, 1, file)) {
+        return -1;
+    }
+    tables->extents.length[block] = stored;
+    CLEAR_UNWRITTEN(&tables->unwritten, block);
+    return 0;
+}
+
+/*
+ * Copies a block to a free one: the stored bytes as they are, compressed or
+ * not, and the table entries that say how they're stored
+ */
+int copyBlock(FILE *file, struct cs1550_tables *tables, long from, long to) {
+    tables->extents.length[to] = tables->extents.length[from];
+    if (IS_UNWRITTEN(&tables->unwritten, from)) {
+        SET_UNWRITTEN(&tables->unwritten, to);
+        return 0;
+    }
+    CLEAR_UNWRITTEN(&tables->unwritten, to);
+    struct cs1550_disk_block *data = getBlock();
+    if (!data) {
+        return -1;
+    }
+    int res = 0;
+    if (readRun(file, from * BLOCK_SIZE, data->data, BLOCK_SIZE) ||
+        writeRun(file, to * BLOCK_SIZE, data->data, BLOCK_SIZE)) {
+        res = -1;
+    }
+    putBlock(data);
+    return res;
+}
+
+/*
+ * Makes blocks 0 through through of the chain at *head private to the file
+ * that's about to change them (-1 for the whole chain). A FAT link can't
+ * differ between the files sharing a block, so each shared block on the way
+ * is copied along with every block in front of it; what's behind the last
+ * one copied stays shared. *head changes if the first block was shared.
+ * Returns 0 or a negative errno; the caller writes the tables back.
+ */
+int unshareChain(FILE *file, struct cs1550_tables *tables, long *head, long through) {
+    long prev = -1;
+    long block = *head;
+    long index = 0;
+    while (block >= 0 && (through < 0 || index <= through)) {
+        if (tables->unwritten.shares[block] > 0) {
+            short next = tables->fat.table[block];
+            if (next >= 0 && tables->unwritten.shares[next] == MAX_SHARES) {
+                return -EMLINK;
+            }
+            int copy = allocateBlock(&tables->fat);
+            if (copy == -1) {
+                printf("\ndisk full\n");
+                return -ENOSPC;
+            }
+            if (copyBlock(file, tables, block, copy)) {
+                return -EIO;
+            }
+            tables->fat.table[copy] = next;
+            if (next >= 0) {
+                tables->unwritten.shares[next]++;
+            }
+            tables->unwritten.shares[block]--;
+            if (prev == -1) {
+                *head = copy;
+            } else {
+                tables->fat.table[prev] = copy;
+            }
+            block = copy;
+        }
+        prev = block;
+        block = tables->fat.table[block];
+        index++;
+    }
+    return 0;
+}
+
+/*
+ * Drops one reference to the chain starting at block, freeing blocks until
+ * it reaches one that something else still shares
+ */
+void releaseChain(struct cs1550_tables *tables, long block) {
+    while (block >= 0) {
+        if (tables->unwritten.shares[block] > 0) {
+            tables->unwritten.shares[block]--;
+            return;
+        }
+        long next = tables->fat.table[block];
+        tables->fat.table[block] = (short) -1;
+        tables->extents.length[block] = 0;
+        CLEAR_UNWRITTEN(&tables->unwritten, block);
+        block = next;
+    }
+}
+
+//whether any block of a chain is also reached from another file or snapshot
+int isShared(struct cs1550_tables *tables, long block) {
+    int blocks = 0;
+    while (block >= 0 && blocks++ < MAX_FAT) {
+        if (tables->unwritten.shares[block] > 0) {
+            return 1;
+        }
+        block = tables->fat.table[block];
+    }
+    return 0;
+}
+
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf) {
+    int res = 0;
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        format(path, directory, filename, extension);
+        struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+        if (!entry) {
+            return -ENOMEM;
+        }
+        int location = findDirectory(directory, entry);
+        if (location != -1) {
+            if (strlen(filename) == 0) {
+                stbuf->st_mode = S_IFDIR | 0755;
+                stbuf->st_nlink = 2;
+            } else {
+                int i;
+                int valid = 0;
+
+                for (i = 0; i < entry->nFiles; i++) {
+                    if (!strcmp(entry->files[i].fname, filename)) {
+                        valid = 1;
+                        break;
+                    }
+                }
+
+                if (valid) {
+                    //regular file, probably want to be read and write
+                    stbuf->st_mode = S_IFREG | 0666;
+                    stbuf->st_nlink = 1; //file links
+                    stbuf->st_size = entry->files[i].fsize;
+                } else {
+                    res = -ENOENT;
+                }
+            }
+        } else {
+            //Else return that path doesn't exist
+            res = -ENOENT;
+        }
+    }
+    return res;
+}
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+    //Since we're building with -Wall (all warnings reported) we need
+    //to "use" every parameter, so let's just cast them to void to
+    //satisfy the compiler
+    (void) offset;
+    (void) fi;
+
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
 
     //This line assumes we have no subdirectories, need to change
     if (strcmp(path, "/") != 0) {
@@ -212,16 +1205,21 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         filler(buf, "..", NULL, 0);
 
         FILE *file;
-        file = fopen(".disk", "rb");
+        file = openDisk();
 
         if (!file) {
             printf("\n.disk error\n");
         } else {
-            struct cs1550_root_directory *root = malloc(sizeof(struct cs1550_root_directory));
+            struct cs1550_root_directory *root = arenaAlloc(sizeof(struct cs1550_root_directory));
+            if (!root) {
+                closeDisk(file);
+                return -ENOMEM;
+            }
 
-            if (!fread(root, sizeof(struct cs1550_root_directory), 1, file)) {
+            if (fseek(file, rootBlock() * BLOCK_SIZE, SEEK_SET) ||
+                !fread(root, sizeof(struct cs1550_root_directory), 1, file)) {
                 printf("\n.disk error\n");
-                fclose(file);
+                closeDisk(file);
                 return -ENOENT;
 
             }
@@ -230,10 +1228,13 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 filler(buf, root->directories[i].dname, NULL, 0);
             }
         }
-        fclose(file);
+        closeDisk(file);
     } else {
         format(path, filename, directory, extension);
-        struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
+        struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+        if (!entry) {
+            return -ENOMEM;
+        }
         int location = findDirectory(directory, entry);
         if (location != 1) {
             filler(buf, ".", NULL, 0);
@@ -274,7 +1275,10 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
 
     format(path, filename, directory, extension);
 
-    struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
+    struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!entry) {
+        return -ENOMEM;
+    }
     int location = findDirectory(directory, entry);
 
     if (strlen(directory) > MAX_FILENAME) {
@@ -289,38 +1293,46 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
         return -EEXIST;
     } else {
         FILE *f;
-        f = fopen(".disk", "rb+");
+        f = openDisk();
 
         if (!f) {
             printf("\n.disk error\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
 
-        struct cs1550_root_directory *root = malloc(sizeof(struct cs1550_root_directory));
+        struct cs1550_root_directory *root = arenaAlloc(sizeof(struct cs1550_root_directory));
+        if (!root) {
+            closeDisk(f);
+            return -ENOMEM;
+        }
 
         if (!fread(root, sizeof(struct cs1550_root_directory), 1, f)) {
             printf("\n.disk error\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
 
         if (root->nDirectories == MAX_DIRS_IN_ROOT) {
             printf("\nroot directory reached capacity\n");
-            fclose(f);
+            closeDisk(f);
             return -EPERM;
         }
 
         strcpy(root->directories[root->nDirectories].dname, directory);
         if (fseek(f, -sizeof(struct cs_1550_fat), SEEK_END)) {
             printf("\nfat error\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
-        struct cs_1550_fat *fat = (struct cs_1550_fat *) malloc(BLOCK_SIZE);
+        struct cs_1550_fat *fat = arenaAlloc(sizeof(struct cs_1550_fat));
+        if (!fat) {
+            closeDisk(f);
+            return -ENOMEM;
+        }
         if (!fread(fat, sizeof(struct cs_1550_fat), 1, f)) {
             printf("\n.disk error\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
         if (fat->table[0] == 0) {
@@ -340,7 +1352,7 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
         }
         if (free_block == -1) {
             printf("\nno free blocks\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
 
@@ -352,35 +1364,40 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
         }
         if (!fwrite(fat, sizeof(struct cs_1550_fat), 1, f)) {
             printf("\nError on writing FAT back to .disk after update\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
         int off = free_block * BLOCK_SIZE;
         if (fseek(f, off, SEEK_SET)) {
             printf("error freeing block on .disk\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
-        struct cs1550_directory_entry *new_dir = (struct cs1550_directory_entry *) malloc(
-                sizeof(struct cs1550_directory_entry));
+        struct cs1550_directory_entry *new_dir = arenaAlloc(sizeof(struct cs1550_directory_entry));
+        if (!new_dir) {
+            closeDisk(f);
+            return -ENOMEM;
+        }
         memset(new_dir, 0, sizeof(struct cs1550_directory_entry));
         if (!fwrite(new_dir, sizeof(struct cs1550_directory_entry), 1, f)) {
             printf("error writing to .disk\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
         root->nDirectories++;
         if (fseek(f, 0, SEEK_SET)) {
             printf("\nerror seeking root on .disk\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
         if (!fwrite(root, sizeof(struct cs1550_root_directory), 1, f)) {
             printf("\nerror writing root to .disk\n");
-            fclose(f);
+            closeDisk(f);
             return -1;
         }
-        fclose(f);
+        closeDisk(f);
+        countFreeBlocks(fat);
+        super.directories++;
 
     }
 
@@ -414,7 +1431,10 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev) {
     } else if (strlen(extension) > MAX_EXTENSION + 1) {
         return -ENAMETOOLONG;
     }
-    struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
+    struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!entry) {
+        return -ENOMEM;
+    }
     int dir = findDirectory(directory, entry);
     if (dir == -1) {
         printf("\ndirectory doesn't exist");
@@ -431,20 +1451,31 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev) {
         }
     }
     FILE *file;
-    file = fopen(".disk", "rb+");
+    file = openDisk();
     if (!file) {
         printf("\nerror opening .disk\n");
-        fclose(file);
+        closeDisk(file);
         return -1;
     }
     if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
-        fclose(file);
+        closeDisk(file);
         return -1;
     }
-    struct cs_1550_fat *fat = (struct cs_1550_fat *) malloc(BLOCK_SIZE);
+    struct cs_1550_fat *fat = arenaAlloc(sizeof(struct cs_1550_fat));
+    if (!fat) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    //taken before the FAT is touched, so running out can't leak a block
+    struct cs1550_disk_block *block = getBlock();
+    if (!block) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
     if (!fread(fat, sizeof(struct cs_1550_fat), 1, file)) {
         printf("\nerror reading table from disk\n");
-        fclose(file);
+        putBlock(block);
+        closeDisk(file);
         return -1;
     }
     int free_block = -1;
@@ -457,395 +1488,2015 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev) {
     }
     if (free_block == -1) {
         printf("\nno free blocs in table\n");
-        fclose(file);
+        putBlock(block);
+        closeDisk(file);
+        return -1;
+    }
+
+
+    strcpy(entry->files[entry->nFiles].fname, filename);
+    strcpy(entry->files[entry->nFiles].fext, extension);
+    entry->files[entry->nFiles].nStartBlock = free_block;
+    entry->files[entry->nFiles].fsize = 0;
+    fat->table[free_block] = (short) -2;
+    if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
+        printf("\nerror seeking in fat\n");
+        putBlock(block);
+        closeDisk(file);
+        return -1;
+    }
+    if (!fwrite(fat, sizeof(struct cs_1550_fat), 1, file)) {
+        printf("\nerror writing fat to .disk\n");
+        putBlock(block);
+        closeDisk(file);
+        return -1;
+    }
+    int off = free_block * BLOCK_SIZE;
+    if (fseek(file, off, SEEK_SET)) {
+        printf("\nerror freeing block in disk\n");
+        putBlock(block);
+        closeDisk(file);
+        return -1;
+    }
+    for (i = 0; i < MAX_DATA_IN_BLOCK; i++) {
+        block->data[i] = 0;
+    }
+    if (!fwrite(block, sizeof(struct cs1550_file_directory), 1, file)) {
+        printf("error writing to .disk\n");
+        putBlock(block);
+        closeDisk(file);
+        return -1;
+    }
+    putBlock(block);
+    entry->nFiles++;
+    off = dir * BLOCK_SIZE;
+    if (fseek(file, off, SEEK_SET)) {
+        printf("\n.disk error\n");
+        closeDisk(file);
+        return -1;
+    }
+    if (!fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+        printf("\nerror writing directory to .disk\n");
+        closeDisk(file);
         return -1;
     }
 
 
-    strcpy(entry->files[entry->nFiles].fname, filename);
-    strcpy(entry->files[entry->nFiles].fext, extension);
-    entry->files[entry->nFiles].nStartBlock = free_block;
-    entry->files[entry->nFiles].fsize = 0;
-    fat->table[free_block] = (short) -2;
-    if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
-        printf("\nerror seeking in fat\n");
-        fclose(file);
-        return -1;
+    closeDisk(file);
+    countFreeBlocks(fat);
+    super.files++;
+
+    return 0;
+}
+
+/*
+ * Deletes a file
+ */
+static int cs1550_unlink(const char *path) {
+    (void) path;
+
+    return 0;
+}
+
+/* 
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    (void) fi;
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+
+    //check to make sure path exists
+    struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!entry) {
+        return -ENOMEM;
+    }
+    int location = findDirectory(directory, entry);
+    if (location == -1) {
+        return -ENOENT;
+    }
+    int i;
+    int file_location = -1;
+    size_t file_size = 0;
+    for (i = 0; i < entry->nFiles; i++) {
+        if (!strcmp(filename, entry->files[i].fname) && !strcmp(extension, entry->files[i].fext)) {
+            file_location = entry->files[i].nStartBlock;
+            file_size = entry->files[i].fsize;
+            break;
+        }
+    }
+    if (file_location == -1) {
+        return -ENOENT;
+    }
+    //nothing to read at or past the end of the file
+    if (size <= 0 || file_size <= offset) {
+        return 0;
+    }
+    //read in data
+    if (file_size < (offset + size)) {
+        size = file_size - offset;
+    }
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+
+    //follow the chain to the block holding offset
+    off_t skip = offset / BLOCK_SIZE;
+    while (skip-- > 0) {
+        if (tables.fat.table[file_location] == -2) {
+            closeDisk(file);
+            return -EIO;
+        }
+        file_location = tables.fat.table[file_location];
+    }
+
+    struct cs1550_disk_block *block = getBlock();
+    if (!block) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    size_t bytes_read = 0;
+    off_t run_pos = 0;
+    size_t run_start = 0, run_size = 0;
+    int block_offset = offset % BLOCK_SIZE;
+    while (bytes_read < size) {
+        size_t read_size = MAX_DATA_IN_BLOCK - block_offset;
+        if (read_size > size - bytes_read) {
+            read_size = size - bytes_read;
+        }
+        if (IS_UNWRITTEN(&tables.unwritten, file_location)) {
+            //hole, nothing on disk to read
+            memset(buf + bytes_read, 0, read_size);
+        } else if (tables.extents.length[file_location] == 0) {
+            //plain block, read along with its neighbours on the volume
+            off_t pos = (off_t) file_location * BLOCK_SIZE + block_offset;
+            if (run_size > 0 && (run_pos + (off_t) run_size != pos || run_start + run_size != bytes_read)) {
+                if (readRun(file, run_pos, buf + run_start, run_size)) {
+                    bytes_read = run_start;
+                    run_size = 0;
+                    break;
+                }
+                run_size = 0;
+            }
+            if (run_size == 0) {
+                run_pos = pos;
+                run_start = bytes_read;
+            }
+            run_size += read_size;
+        } else {
+            if (readDataBlock(file, file_location, &tables, block->data)) {
+                break;
+            }
+            memcpy(buf + bytes_read, &block->data[block_offset], read_size);
+        }
+        bytes_read += read_size;
+        block_offset = 0;
+        if (bytes_read < size) {
+            if (tables.fat.table[file_location] == -2) {
+                break;
+            }
+            file_location = tables.fat.table[file_location];
+        }
+    }
+    if (run_size > 0 && readRun(file, run_pos, buf + run_start, run_size)) {
+        bytes_read = run_start;
+    }
+    putBlock(block);
+    closeDisk(file);
+
+    if (bytes_read == 0) {
+        return -EIO;
+    }
+    return bytes_read;
+}
+
+/*
+ * Makes sure the bytes of a file block past the old end of file read back as
+ * zeros once the file grows over them. Whole blocks past the end just become
+ * unwritten; only the block holding the old end of file needs I/O.
+ */
+int clearPastEnd(FILE *file, long block, off_t block_start, size_t file_size,
+                 struct cs1550_tables *tables) {
+    struct cs1550_disk_block data;
+    size_t valid = 0;
+    if ((off_t) file_size > block_start) {
+        valid = file_size - block_start;
+    }
+    if (valid >= MAX_DATA_IN_BLOCK || IS_UNWRITTEN(&tables->unwritten, block)) {
+        return 0;
+    }
+    if (valid == 0) {
+        SET_UNWRITTEN(&tables->unwritten, block);
+        return 0;
+    }
+    if (readDataBlock(file, block, tables, data.data)) {
+        return -1;
+    }
+    memset(&data.data[valid], 0, MAX_DATA_IN_BLOCK - valid);
+    return writeDataBlock(file, block, tables, data.data);
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi) {
+    (void) fi;
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+
+
+    //check to make sure path exists
+    struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!entry) {
+        return -ENOMEM;
+    }
+    int location = findDirectory(directory, entry);
+    if (location == -1) {
+        return -ENOENT;
+    }
+    size_t file_size = 0;
+    int found_index = -1;
+    int found_location = -1;
+    int i = 0;
+    for (i = 0; i < entry->nFiles; i++) {
+        if (!strcmp(filename, entry->files[i].fname) && !strcmp(extension, entry->files[i].fext)) {
+            found_index = i;
+            found_location = entry->files[i].nStartBlock;
+            file_size = entry->files[i].fsize;
+            break;
+        }
+    }
+
+    if (found_index == -1) {
+        return -ENOENT;
+    }
+    //write data
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        return -EIO;
+    }
+
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+
+    //a clone or snapshot may share the blocks this write changes
+    long found_start = found_location;
+    int res = unshareChain(file, &tables, &found_start, (offset + size - (size > 0)) / BLOCK_SIZE);
+    if (res) {
+        closeDisk(file);
+        return res;
+    }
+    found_location = found_start;
+
+    //follow the chain to the block holding offset. Writing past the end of
+    //the file leaves a hole, so link in unwritten blocks until we get there.
+    off_t block_start = 0;
+    while (block_start + BLOCK_SIZE <= offset) {
+        if (clearPastEnd(file, found_location, block_start, file_size, &tables)) {
+            closeDisk(file);
+            return -EIO;
+        }
+        if (tables.fat.table[found_location] == -2) {
+            int free_block = allocateBlock(&tables.fat);
+            if (free_block == -1) {
+                closeDisk(file);
+                return -ENOSPC;
+            }
+            SET_UNWRITTEN(&tables.unwritten, free_block);
+            tables.fat.table[found_location] = free_block;
+        }
+        found_location = tables.fat.table[found_location];
+        block_start += BLOCK_SIZE;
+    }
+
+    struct cs1550_disk_block *block = getBlock();
+    if (!block) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    size_t bytes_written = 0;
+    int error = 0;
+    off_t run_pos = 0;
+    size_t run_start = 0, run_size = 0;
+    int block_offset = offset - block_start;
+    while (bytes_written < size) {
+        size_t write_size = MAX_DATA_IN_BLOCK - block_offset;
+        if (write_size > size - bytes_written) {
+            write_size = size - bytes_written;
+        }
+        if (write_size == MAX_DATA_IN_BLOCK && !options.compress) {
+            //whole plain block, written along with its neighbours on the volume
+            off_t pos = (off_t) found_location * BLOCK_SIZE;
+            if (run_size > 0 && (run_pos + (off_t) run_size != pos || run_start + run_size != bytes_written)) {
+                if (writeRun(file, run_pos, buf + run_start, run_size)) {
+                    bytes_written = run_start;
+                    run_size = 0;
+                    error = -EIO;
+                    break;
+                }
+                run_size = 0;
+            }
+            if (run_size == 0) {
+                run_pos = pos;
+                run_start = bytes_written;
+            }
+            run_size += write_size;
+            tables.extents.length[found_location] = 0;
+            CLEAR_UNWRITTEN(&tables.unwritten, found_location);
+        } else {
+            if (write_size < MAX_DATA_IN_BLOCK) {
+                //partial block, keep what's around the new data
+                if (readDataBlock(file, found_location, &tables, block->data)) {
+                    error = -EIO;
+                    break;
+                }
+                if (block_start + BLOCK_SIZE > (off_t) file_size) {
+                    size_t valid = (off_t) file_size > block_start ? file_size - block_start : 0;
+                    memset(&block->data[valid], 0, MAX_DATA_IN_BLOCK - valid);
+                }
+            }
+            memcpy(&block->data[block_offset], buf + bytes_written, write_size);
+            if (writeDataBlock(file, found_location, &tables, block->data)) {
+                error = -EIO;
+                break;
+            }
+        }
+        bytes_written += write_size;
+        block_offset = 0;
+        block_start += BLOCK_SIZE;
+        if (bytes_written < size) {
+            if (tables.fat.table[found_location] == -2) {
+                int free_block = allocateBlock(&tables.fat);
+                if (free_block == -1) {
+                    error = -ENOSPC;
+                    break;
+                }
+                SET_UNWRITTEN(&tables.unwritten, free_block);
+                tables.fat.table[found_location] = free_block;
+            }
+            found_location = tables.fat.table[found_location];
+        }
+    }
+    if (run_size > 0 && writeRun(file, run_pos, buf + run_start, run_size)) {
+        bytes_written = run_start;
+        error = -EIO;
+    }
+    putBlock(block);
+    if (writeTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    if ((offset + bytes_written) > file_size || found_start != entry->files[found_index].nStartBlock) {
+        if ((offset + bytes_written) > file_size) {
+            entry->files[found_index].fsize = offset + bytes_written;
+        }
+        entry->files[found_index].nStartBlock = found_start;
+        if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+            !fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            closeDisk(file);
+            return -EIO;
+        }
+    }
+    closeDisk(file);
+
+    if (bytes_written == 0 && size > 0) {
+        return error ? error : -EIO;
+    }
+    return bytes_written;
+}
+
+/*
+ * Links extra unwritten blocks onto the chain ending at tail, taken from one
+ * contiguous run when there is one. -ENOSPC, with nothing linked, if there
+ * aren't that many free.
+ */
+static int reserveBlocks(struct cs1550_tables *tables, long tail, int extra) {
+    int i;
+    int start = findFreeRun(&tables->fat, tail + 1, extra);
+    if (start == -1) {
+        int free_blocks = 0;
+        for (i = 0; i < MAX_FAT; i++) {
+            if (tables->fat.table[i] == (short) -1) {
+                free_blocks++;
+            }
+        }
+        if (free_blocks < extra) {
+            return -ENOSPC;
+        }
+    }
+    for (i = 0; i < extra; i++) {
+        int free_block;
+        if (start != -1) {
+            free_block = start + i;
+            tables->fat.table[free_block] = (short) -2;
+        } else {
+            free_block = allocateBlock(&tables->fat);
+        }
+        SET_UNWRITTEN(&tables->unwritten, free_block);
+        tables->fat.table[tail] = free_block;
+        tail = free_block;
+    }
+    return 0;
+}
+
+/*
+ * Reserves the blocks backing [offset, offset + length) with a single FAT
+ * update. New blocks come from one contiguous run when there is one, and are
+ * left unwritten so they read back as zeros until data lands in them.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length,
+                            struct fuse_file_info *fi) {
+    (void) fi;
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    //no chain in the FAT reaches past MAX_FAT blocks, free or not
+    if (offset > (off_t) MAX_FAT * BLOCK_SIZE || length > (off_t) MAX_FAT * BLOCK_SIZE - offset) {
+        return -EFBIG;
+    }
+
+    struct cs1550_directory_entry entry;
+    int location = findDirectory(directory, &entry);
+    if (location == -1) {
+        return -ENOENT;
+    }
+    int i;
+    int found_index = -1;
+    for (i = 0; i < entry.nFiles; i++) {
+        if (!strcmp(filename, entry.files[i].fname) && !strcmp(extension, entry.files[i].fext)) {
+            found_index = i;
+            break;
+        }
+    }
+    if (found_index == -1) {
+        return -ENOENT;
+    }
+
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+
+    size_t file_size = entry.files[found_index].fsize;
+    size_t new_size = file_size;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && (size_t) (offset + length) > file_size) {
+        new_size = offset + length;
+    }
+
+    //growing the file or its chain changes blocks a clone may share
+    off_t need = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int have = 0;
+    long tail;
+    for (tail = entry.files[found_index].nStartBlock; tail >= 0; tail = tables.fat.table[tail]) {
+        have++;
+    }
+    long head = entry.files[found_index].nStartBlock;
+    if (new_size != file_size || need > have) {
+        int res = unshareChain(file, &tables, &head, -1);
+        if (res) {
+            closeDisk(file);
+            return res;
+        }
+    }
+
+    //walk the existing chain, zeroing whatever the new size exposes
+    tail = head;
+    off_t block_start = 0;
+    have = 1;
+    while (1) {
+        if (new_size != file_size && clearPastEnd(file, tail, block_start, file_size, &tables)) {
+            closeDisk(file);
+            return -EIO;
+        }
+        if (tables.fat.table[tail] == -2) {
+            break;
+        }
+        tail = tables.fat.table[tail];
+        block_start += BLOCK_SIZE;
+        have++;
+    }
+
+    if (need > have && reserveBlocks(&tables, tail, need - have)) {
+        closeDisk(file);
+        return -ENOSPC;
+    }
+    if (writeTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+
+    if (new_size != file_size || head != entry.files[found_index].nStartBlock) {
+        entry.files[found_index].fsize = new_size;
+        entry.files[found_index].nStartBlock = head;
+        if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+            !fwrite(&entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            closeDisk(file);
+            return -EIO;
+        }
+    }
+    closeDisk(file);
+
+    return 0;
+}
+
+//write_buf's way through cs1550_write, for the writes it can't splice
+static int writeCopy(const char *path, struct fuse_bufvec *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+    struct fuse_bufvec copy = FUSE_BUFVEC_INIT(size);
+    copy.buf[0].mem = arenaAlloc(size);
+    if (!copy.buf[0].mem) {
+        return -ENOMEM;
+    }
+    ssize_t copied = fuse_buf_copy(&copy, buf, 0);
+    if (copied < 0) {
+        return copied;
+    }
+    return cs1550_write(path, copy.buf[0].mem, copied, offset, fi);
+}
+
+/*
+ * Zero-copy write. The blocks are unshared and reserved up front on one copy
+ * of the tables, then every whole plain block is described to libfuse as an
+ * fd+offset piece of .disk so it can splice the data in from /dev/fuse. The
+ * partial blocks at either end land in scratch memory and are merged into
+ * their blocks afterwards. Compressing, writing past the end of the file, or
+ * running out of blocks goes through cs1550_write instead.
+ */
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi) {
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+
+    size_t size = fuse_buf_size(buf);
+    struct cs1550_directory_entry *entry = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!entry) {
+        return -ENOMEM;
+    }
+    int location = findDirectory(directory, entry);
+    if (location == -1) {
+        return -ENOENT;
+    }
+    int index = findFile(entry, filename, extension);
+    if (index == -1) {
+        return -ENOENT;
+    }
+    size_t file_size = entry->files[index].fsize;
+    if (size == 0) {
+        return 0;
+    }
+    if (offset > (off_t) MAX_FAT * BLOCK_SIZE || size > (size_t) MAX_FAT * BLOCK_SIZE - offset) {
+        return -EFBIG;
+    }
+    if (options.compress || (size_t) offset > file_size) {
+        return writeCopy(path, buf, size, offset, fi);
+    }
+
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+
+    //a clone or snapshot may share the blocks about to be overwritten, or
+    //the tail if the chain has to grow
+    long head = entry->files[index].nStartBlock;
+    off_t need = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int have = 0;
+    long tail;
+    for (tail = head; tail >= 0; tail = tables.fat.table[tail]) {
+        have++;
+    }
+    int res = unshareChain(file, &tables, &head, need > have ? -1 : (long) ((offset + size - 1) / BLOCK_SIZE));
+    if (res) {
+        closeDisk(file);
+        return res;
+    }
+    for (tail = head; tables.fat.table[tail] >= 0; tail = tables.fat.table[tail]);
+    if (need > have && reserveBlocks(&tables, tail, need - have)) {
+        closeDisk(file);
+        return writeCopy(path, buf, size, offset, fi);
+    }
+
+    long block = head;
+    off_t skip = offset / BLOCK_SIZE;
+    while (skip-- > 0) {
+        block = tables.fat.table[block];
+    }
+
+    //whole blocks land straight in .disk, the partial ends in scratch memory
+    size_t pieces = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    struct fuse_bufvec *dst = arenaAlloc(sizeof(struct fuse_bufvec) + pieces * sizeof(struct fuse_buf));
+    struct {
+        long block;
+        int block_offset;
+        size_t length;
+        char *mem;    //NULL for a whole block spliced into place
+    } *target = arenaAlloc(pieces * sizeof(*target));
+    if (!dst || !target) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    dst->count = 0;
+    dst->idx = 0;
+    dst->off = 0;
+
+    size_t done = 0;
+    int targets = 0;
+    int block_offset = offset % BLOCK_SIZE;
+    while (done < size) {
+        size_t length = MAX_DATA_IN_BLOCK - block_offset;
+        if (length > size - done) {
+            length = size - done;
+        }
+        struct fuse_buf *last = dst->count ? &dst->buf[dst->count - 1] : NULL;
+        target[targets].block = block;
+        target[targets].block_offset = block_offset;
+        target[targets].length = length;
+        target[targets].mem = NULL;
+        if (length == MAX_DATA_IN_BLOCK) {
+            int fd;
+            off_t pos;
+            volumeLocate((off_t) block * BLOCK_SIZE, &fd, &pos);
+            if (last && (last->flags & FUSE_BUF_IS_FD) && last->fd == fd && last->pos + (off_t) last->size == pos) {
+                last->size += length;
+            } else {
+                last = &dst->buf[dst->count++];
+                last->size = length;
+                last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                last->mem = NULL;
+                last->fd = fd;
+                last->pos = pos;
+            }
+        } else {
+            last = &dst->buf[dst->count++];
+            last->size = length;
+            last->flags = 0;
+            last->mem = arenaAlloc(length);
+            if (!last->mem) {
+                closeDisk(file);
+                return -ENOMEM;
+            }
+            last->fd = -1;
+            last->pos = 0;
+            target[targets].mem = last->mem;
+        }
+        targets++;
+        done += length;
+        block_offset = 0;
+        block = tables.fat.table[block];
+    }
+
+    //the blocks unshareChain copied may still be in the stream's buffer
+    if (fflush(file)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    ssize_t copied = fuse_buf_copy(dst, buf, 0);
+    if (copied < 0) {
+        closeDisk(file);
+        return copied;
+    }
+
+    //only what arrived whole counts as written, and only now may the tables
+    //and the size say so
+    struct cs1550_disk_block *data = getBlock();
+    if (!data) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    size_t written = 0;
+    int i;
+    for (i = 0; i < targets && written + target[i].length <= (size_t) copied; i++) {
+        if (target[i].mem) {
+            off_t block_start = offset + written - target[i].block_offset;
+            if (readDataBlock(file, target[i].block, &tables, data->data)) {
+                res = -EIO;
+                break;
+            }
+            if (block_start + BLOCK_SIZE > (off_t) file_size) {
+                size_t valid = (off_t) file_size > block_start ? file_size - block_start : 0;
+                memset(&data->data[valid], 0, MAX_DATA_IN_BLOCK - valid);
+            }
+            memcpy(&data->data[target[i].block_offset], target[i].mem, target[i].length);
+            if (writeDataBlock(file, target[i].block, &tables, data->data)) {
+                res = -EIO;
+                break;
+            }
+        } else {
+            CLEAR_UNWRITTEN(&tables.unwritten, target[i].block);
+            tables.extents.length[target[i].block] = 0;
+        }
+        written += target[i].length;
+    }
+    putBlock(data);
+    if (writeTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    if (offset + written > file_size || head != entry->files[index].nStartBlock) {
+        if (offset + written > file_size) {
+            entry->files[index].fsize = offset + written;
+        }
+        entry->files[index].nStartBlock = head;
+        if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+            !fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror writing directory to .disk\n");
+            closeDisk(file);
+            return -EIO;
+        }
+    }
+    closeDisk(file);
+
+    if (written == 0) {
+        return res ? res : -EIO;
+    }
+    return written;
+}
+
+#define COMPRESSION_XATTR "user.cs1550.compression"
+#define FRAGMENTATION_XATTR "user.cs1550.fragmentation"
+#define MEMORY_XATTR "user.cs1550.memory"
+
+//copies an attribute value out the way getxattr expects
+static int xattrReply(const char *report, int length, char *value, size_t size) {
+    if (size == 0) {
+        return length;
+    }
+    if (size < (size_t) length) {
+        return -ERANGE;
+    }
+    memcpy(value, report, length);
+    return length;
+}
+
+/*
+ * Counts the places where a chain jumps somewhere other than the next
+ * physical block. blocks is set to the chain length.
+ */
+int countFragments(struct cs_1550_fat *fat, long start, int *blocks) {
+    int breaks = 0;
+    *blocks = 0;
+    while (start >= 0 && *blocks < MAX_FAT) {
+        (*blocks)++;
+        if (fat->table[start] >= 0 && fat->table[start] != start + 1) {
+            breaks++;
+        }
+        start = fat->table[start];
+    }
+    return breaks;
+}
+
+/*
+ * Reports how a file's blocks are stored, e.g.
+ * getfattr -n user.cs1550.compression /mnt/dir/file.txt
+ * getfattr -n user.cs1550.fragmentation /mnt/dir/file.txt
+ * and what the request path holds on to, on the root:
+ * getfattr -n user.cs1550.memory /mnt
+ */
+static int cs1550_getxattr(const char *path, const char *name, char *value, size_t size) {
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    char report[256];
+    int length;
+
+    if (!strcmp(path, "/")) {
+        if (strcmp(name, MEMORY_XATTR)) {
+            return -ENODATA;
+        }
+        long threads = __atomic_load_n(&memory_threads, __ATOMIC_RELAXED);
+        long arena_bytes = __atomic_load_n(&memory_arena_bytes, __ATOMIC_RELAXED);
+        long pool_blocks = __atomic_load_n(&memory_pool_blocks, __ATOMIC_RELAXED);
+        long hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+        long misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+        length = snprintf(report, sizeof(report),
+                          "threads=%ld arena_bytes=%ld pool_blocks=%ld cache_pages=%ld cache_hits=%ld "
+                          "cache_misses=%ld total=%ld\n",
+                          threads, arena_bytes, pool_blocks, memory_cache_pages, hits, misses,
+                          arena_bytes + pool_blocks * BLOCK_SIZE + memory_cache_pages * CACHE_PAGE);
+        return xattrReply(report, length, value, size);
+    }
+    format(path, directory, filename, extension);
+
+    if (strcmp(name, COMPRESSION_XATTR) && strcmp(name, FRAGMENTATION_XATTR)) {
+        return -ENODATA;
+    }
+    struct cs1550_directory_entry entry;
+    if (findDirectory(directory, &entry) == -1) {
+        return -ENOENT;
+    }
+    int index = findFile(&entry, filename, extension);
+    if (index == -1) {
+        return -ENODATA;
+    }
+
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    closeDisk(file);
+
+    int blocks = 0;
+    if (!strcmp(name, FRAGMENTATION_XATTR)) {
+        //score is the share of links in the chain that aren't sequential
+        int breaks = countFragments(&tables.fat, entry.files[index].nStartBlock, &blocks);
+        length = snprintf(report, sizeof(report), "blocks=%d fragments=%d score=%d%%\n",
+                          blocks, breaks + 1, blocks > 1 ? breaks * 100 / (blocks - 1) : 0);
+    } else {
+        int holes = 0, compressed = 0;
+        long stored = 0;
+        long block = entry.files[index].nStartBlock;
+        while (block >= 0 && blocks < MAX_FAT) {
+            blocks++;
+            if (IS_UNWRITTEN(&tables.unwritten, block)) {
+                holes++;
+            } else if (tables.extents.length[block]) {
+                compressed++;
+                stored += tables.extents.length[block];
+            } else {
+                stored += BLOCK_SIZE;
+            }
+            block = tables.fat.table[block];
+        }
+        long logical = (long) (blocks - holes) * BLOCK_SIZE;
+        length = snprintf(report, sizeof(report),
+                          "blocks=%d holes=%d compressed=%d logical=%ld stored=%ld ratio=%ld%%\n",
+                          blocks, holes, compressed, logical, stored, logical ? stored * 100 / logical : 100);
+    }
+    return xattrReply(report, length, value, size);
+}
+
+static int cs1550_listxattr(const char *path, char *list, size_t size) {
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+
+    static const char names[] = COMPRESSION_XATTR "\0" FRAGMENTATION_XATTR;
+    struct cs1550_directory_entry entry;
+    if (!strcmp(path, "/")) {
+        if (size == 0) {
+            return sizeof(MEMORY_XATTR);
+        }
+        if (size < sizeof(MEMORY_XATTR)) {
+            return -ERANGE;
+        }
+        memcpy(list, MEMORY_XATTR, sizeof(MEMORY_XATTR));
+        return sizeof(MEMORY_XATTR);
+    }
+    if (strlen(filename) == 0 || findDirectory(directory, &entry) == -1 ||
+        findFile(&entry, filename, extension) == -1) {
+        return 0;
+    }
+    if (size == 0) {
+        return sizeof(names);
+    }
+    if (size < sizeof(names)) {
+        return -ERANGE;
+    }
+    memcpy(list, names, sizeof(names));
+    return sizeof(names);
+}
+
+/*
+ * Moves one file's chain into a contiguous free run. The copies and the new
+ * chain are written first, then the directory entry is switched over to the
+ * new start block in a single block write, and only then is the old chain
+ * freed. The volume is synced after the first two steps, so they reach the
+ * images in that order and a crash part way through leaks blocks but never
+ * loses data.
+ * Returns the number of blocks moved, 0 if there's no run big enough.
+ */
+int relocateFile(FILE *file, struct cs1550_tables *tables, struct cs1550_directory_entry *entry,
+                 long location, int index, int blocks) {
+    int start = findFreeRun(&tables->fat, -1, blocks);
+    if (start == -1) {
+        return 0;
+    }
+
+    struct cs1550_disk_block block;
+    long old_block = entry->files[index].nStartBlock;
+    int i;
+    for (i = 0; i < blocks; i++) {
+        int new_block = start + i;
+        //copy the stored bytes as they are, compressed or not
+        if (!IS_UNWRITTEN(&tables->unwritten, old_block)) {
+            if (fseek(file, old_block * BLOCK_SIZE, SEEK_SET) || !fread(block.data, BLOCK_SIZE, 1, file) ||
+                fseek(file, new_block * BLOCK_SIZE, SEEK_SET) || !fwrite(block.data, BLOCK_SIZE, 1, file)) {
+                printf("\nerror copying block %ld during defrag\n", old_block);
+                return -1;
+            }
+            CLEAR_UNWRITTEN(&tables->unwritten, new_block);
+        } else {
+            SET_UNWRITTEN(&tables->unwritten, new_block);
+        }
+        tables->extents.length[new_block] = tables->extents.length[old_block];
+        tables->fat.table[new_block] = i == blocks - 1 ? (short) -2 : new_block + 1;
+        old_block = tables->fat.table[old_block];
+    }
+    if (writeTables(file, tables) || syncVolume(file)) {
+        return -1;
+    }
+
+    old_block = entry->files[index].nStartBlock;
+    entry->files[index].nStartBlock = start;
+    if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+        !fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file) || syncVolume(file)) {
+        printf("\nerror writing directory during defrag\n");
+        return -1;
+    }
+
+    while (old_block >= 0) {
+        long next = tables->fat.table[old_block];
+        tables->fat.table[old_block] = (short) -1;
+        tables->extents.length[old_block] = 0;
+        CLEAR_UNWRITTEN(&tables->unwritten, old_block);
+        old_block = next;
+    }
+    if (writeTables(file, tables)) {
+        return -1;
+    }
+    fflush(file);
+    return blocks;
+}
+
+/*
+ * Finds the first fragmented file that fits in a contiguous free run and
+ * moves it there. Returns the number of blocks moved, 0 once there's nothing
+ * left that can be improved.
+ */
+int defragmentStep(void) {
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -1;
+    }
+    struct cs1550_root_directory root;
+    struct cs1550_tables tables;
+    if (!fread(&root, sizeof(struct cs1550_root_directory), 1, file) || readTables(file, &tables)) {
+        printf("\nerror reading .disk for defrag\n");
+        closeDisk(file);
+        return -1;
+    }
+
+    int moved = 0;
+    int d, i;
+    for (d = 0; d < root.nDirectories && moved == 0; d++) {
+        struct cs1550_directory_entry entry;
+        long location = root.directories[d].nStartBlock;
+        if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+            !fread(&entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror reading directory for defrag\n");
+            moved = -1;
+            break;
+        }
+        for (i = 0; i < entry.nFiles && moved == 0; i++) {
+            int blocks;
+            //moving a shared block would have to update every file sharing it
+            if (countFragments(&tables.fat, entry.files[i].nStartBlock, &blocks) > 0 &&
+                !isShared(&tables, entry.files[i].nStartBlock)) {
+                moved = relocateFile(file, &tables, &entry, location, i, blocks);
+            }
+        }
+    }
+    closeDisk(file);
+    return moved;
+}
+
+//Every operation holds disk_lock, shared for lookups and reads and exclusive
+//for anything that changes the disk, so the defragmenter only ever moves
+//blocks between two operations and never in the middle of one.
+static pthread_rwlock_t disk_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_running = 0;
+
+//how long to wait before looking again once everything is contiguous
+#define DEFRAG_IDLE_SECONDS 30
+
+/*
+ * Background pass started at mount with -o defrag=N, which moves at most N
+ * blocks per second. Sleeps on defrag_cond so unmount can wake it.
+ */
+static void *defragmenter(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&defrag_mutex);
+    while (defrag_running) {
+        pthread_mutex_unlock(&defrag_mutex);
+        pthread_rwlock_wrlock(&disk_lock);
+        int moved = defragmentStep();
+        pthread_rwlock_unlock(&disk_lock);
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        if (moved > 0) {
+            long long nanos = (long long) moved * 1000000000LL / options.defrag_rate;
+            until.tv_sec += nanos / 1000000000LL;
+            until.tv_nsec += nanos % 1000000000LL;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+        } else {
+            until.tv_sec += DEFRAG_IDLE_SECONDS;
+        }
+        pthread_mutex_lock(&defrag_mutex);
+        if (defrag_running) {
+            pthread_cond_timedwait(&defrag_cond, &defrag_mutex, &until);
+        }
+    }
+    pthread_mutex_unlock(&defrag_mutex);
+    return NULL;
+}
+
+int readSuperblock(FILE *file, struct cs1550_superblock *sb) {
+    if (fseek(file, SUPERBLOCK_OFFSET, SEEK_END) || !fread(sb, sizeof(struct cs1550_superblock), 1, file)) {
+        printf("\nerror reading superblock from .disk\n");
+        return -1;
+    }
+    return 0;
+}
+
+int writeSuperblock(FILE *file, struct cs1550_superblock *sb) {
+    if (fseek(file, SUPERBLOCK_OFFSET, SEEK_END) || !fwrite(sb, sizeof(struct cs1550_superblock), 1, file)) {
+        printf("\nerror writing superblock to .disk\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Loads the superblock at mount. After a clean unmount the counts are used as
+ * they are; otherwise (first mount, crash) they're rebuilt by scanning the FAT
+ * and every directory. Either way the on-disk copy is marked dirty until
+ * unmount.
+ */
+int mountSuperblock(void) {
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -1;
+    }
+    if (readSuperblock(file, &super)) {
+        closeDisk(file);
+        return -1;
+    }
+    if (super.magic != CS1550_MAGIC || super.version != CS1550_VERSION || !super.clean) {
+        struct cs1550_root_directory root;
+        struct cs1550_tables tables;
+        struct cs1550_superblock old = super;
+        printf("\nsuperblock missing or not clean, rebuilding its counts\n");
+        if (fseek(file, 0, SEEK_SET) || !fread(&root, sizeof(struct cs1550_root_directory), 1, file) ||
+            readTables(file, &tables) || root.nDirectories < 0 || root.nDirectories > (int) (MAX_DIRS_IN_ROOT)) {
+            printf("\nerror scanning .disk\n");
+            closeDisk(file);
+            return -1;
+        }
+        memset(&super, 0, sizeof(struct cs1550_superblock));
+        super.magic = CS1550_MAGIC;
+        super.version = CS1550_VERSION;
+        super.block_size = BLOCK_SIZE;
+        super.fat_entries = MAX_FAT;
+        //the snapshot list isn't a count that can be rebuilt, keep it
+        if (old.magic == CS1550_MAGIC && old.snapshots > 0 && old.snapshots <= MAX_SNAPSHOTS) {
+            super.snapshots = old.snapshots;
+            memcpy(super.snapshot, old.snapshot, sizeof(super.snapshot));
+        }
+        countFreeBlocks(&tables.fat);
+        super.directories = root.nDirectories;
+        int i;
+        for (i = 0; i < root.nDirectories; i++) {
+            struct cs1550_directory_entry entry;
+            if (root.directories[i].nStartBlock <= 0 || root.directories[i].nStartBlock >= (long) MAX_FAT ||
+                fseek(file, root.directories[i].nStartBlock * BLOCK_SIZE, SEEK_SET) ||
+                !fread(&entry, sizeof(struct cs1550_directory_entry), 1, file) ||
+                entry.nFiles < 0 || entry.nFiles > (int) (MAX_FILES_IN_DIR)) {
+                printf("\nerror scanning directory %d\n", i);
+                closeDisk(file);
+                return -1;
+            }
+            super.files += entry.nFiles;
+        }
+    }
+    fseek(file, 0, SEEK_END);
+    super.total_blocks = ftell(file) / BLOCK_SIZE;
+    super.members = volume.members;
+    super.stripe = volume.stripe;
+    super.clean = 0;
+    int res = writeSuperblock(file, &super) || syncVolume(file) ? -1 : 0;
+    closeDisk(file);
+    return res;
+}
+
+int unmountSuperblock(void) {
+    FILE *file;
+    file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -1;
+    }
+    //the volume is only clean once everything before this is on the images,
+    //and only stays so once the superblock saying so is too
+    if (syncVolume(file)) {
+        closeDisk(file);
+        return -1;
+    }
+    super.clean = 1;
+    int res = writeSuperblock(file, &super) || syncVolume(file) ? -1 : 0;
+    closeDisk(file);
+    return res;
+}
+
+/*
+ * Answers df from the in-memory superblock, without touching the disk
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf) {
+    (void) path;
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = super.fat_entries;
+    stbuf->f_bfree = super.free_blocks;
+    stbuf->f_bavail = super.free_blocks;
+    //every directory and file needs a block, so that caps both
+    stbuf->f_files = super.fat_entries;
+    stbuf->f_ffree = super.free_blocks;
+    stbuf->f_favail = super.free_blocks;
+    stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+    return 0;
+}
+
+/*
+ * Splits "/dir/file.ext" like format() does, but refuses names that don't
+ * fit rather than overrunning the buffers
+ */
+int splitPath(const char *path, char *directory, char *filename, char *extension) {
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    const char *name = strchr(path + 1, '/');
+    if (!name++ || strchr(name, '/')) {
+        return -EINVAL;
+    }
+    const char *dot = strchr(name, '.');
+    size_t directory_length = name - path - 2;
+    size_t filename_length = dot ? (size_t) (dot - name) : strlen(name);
+    size_t extension_length = dot ? strlen(dot + 1) : 0;
+    if (directory_length == 0 || filename_length == 0) {
+        return -EINVAL;
+    }
+    if (directory_length > MAX_FILENAME || filename_length > MAX_FILENAME || extension_length > MAX_EXTENSION) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(directory, path + 1, directory_length);
+    directory[directory_length] = '\0';
+    memcpy(filename, name, filename_length);
+    filename[filename_length] = '\0';
+    memcpy(extension, dot ? dot + 1 : "", extension_length);
+    extension[extension_length] = '\0';
+    return 0;
+}
+
+/*
+ * Makes target a copy of the file at path by pointing it at the same chain.
+ * No data moves; each file copies blocks for itself as it writes them, so
+ * this also restores a file out of a snapshot.
+ */
+static int cs1550_clone(const char *path, const char *target) {
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    char to_directory[MAX_FILENAME + 1];
+    char to_filename[MAX_FILENAME + 1];
+    char to_extension[MAX_EXTENSION + 1];
+    format(path, directory, filename, extension);
+    int res = splitPath(target, to_directory, to_filename, to_extension);
+    if (res) {
+        return res;
+    }
+
+    struct cs1550_directory_entry *from = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!from) {
+        return -ENOMEM;
+    }
+    if (findDirectory(directory, from) == -1) {
+        return -ENOENT;
+    }
+    int index = findFile(from, filename, extension);
+    if (index == -1) {
+        return -ENOENT;
+    }
+    //the copy always goes in the live volume
+    threadState()->root = 0;
+    struct cs1550_directory_entry *to = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!to) {
+        return -ENOMEM;
+    }
+    int location = findDirectory(to_directory, to);
+    if (location == -1) {
+        return -ENOENT;
+    }
+    if (findFile(to, to_filename, to_extension) != -1) {
+        return -EEXIST;
+    }
+    if (to->nFiles >= (int) (MAX_FILES_IN_DIR)) {
+        return -ENOSPC;
+    }
+
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    long head = from->files[index].nStartBlock;
+    if (tables.unwritten.shares[head] == MAX_SHARES) {
+        closeDisk(file);
+        return -EMLINK;
+    }
+    tables.unwritten.shares[head]++;
+
+    struct cs1550_file_directory *record = &to->files[to->nFiles++];
+    memset(record, 0, sizeof(struct cs1550_file_directory));
+    strcpy(record->fname, to_filename);
+    strcpy(record->fext, to_extension);
+    record->fsize = from->files[index].fsize;
+    record->nStartBlock = head;
+    if (writeTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    if (fseek(file, location * BLOCK_SIZE, SEEK_SET) ||
+        !fwrite(to, sizeof(struct cs1550_directory_entry), 1, file)) {
+        printf("\nerror writing directory to .disk\n");
+        closeDisk(file);
+        return -EIO;
+    }
+    closeDisk(file);
+    super.files++;
+    return 0;
+}
+
+//Snapshots are read-only views of the volume under /.snap/name. Each one is
+//a copy of the root and of every directory block, listed in the superblock;
+//the files in the copied directories share their chains with the live ones.
+
+#define SNAPSHOT_DIR "/.snap"
+
+//what enterSnapshot found a path to be
+#define IN_VOLUME 0       //resolve as usual, against the live root or a snapshot's
+#define SNAPSHOT_LIST 1   ///.snap itself
+#define SNAPSHOT_ROOT 2   ///.snap/name itself
+
+int findSnapshot(const char *name) {
+    int i;
+    for (i = 0; i < super.snapshots; i++) {
+        if (!strcmp(super.snapshot[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//anything under /.snap is read-only
+int inSnapshot(const char *path) {
+    size_t prefix = strlen(SNAPSHOT_DIR);
+    return !strncmp(path, SNAPSHOT_DIR, prefix) && (path[prefix] == '/' || path[prefix] == '\0');
+}
+
+/*
+ * For /.snap/name/dir/... points the thread at that snapshot's root and
+ * leaves *path as /dir/...; for /.snap/name sets *index. Returns one of the
+ * above, or -ENOENT for a snapshot that doesn't exist.
+ */
+int enterSnapshot(const char **path, int *index) {
+    if (!inSnapshot(*path)) {
+        return IN_VOLUME;
+    }
+    const char *name = *path + strlen(SNAPSHOT_DIR);
+    if (name[0] == '\0' || !strcmp(name, "/")) {
+        return SNAPSHOT_LIST;
+    }
+    name++;
+    const char *rest = strchr(name, '/');
+    size_t length = rest ? (size_t) (rest - name) : strlen(name);
+    char snapshot[MAX_FILENAME + 1];
+    if (length > MAX_FILENAME) {
+        return -ENOENT;
+    }
+    memcpy(snapshot, name, length);
+    snapshot[length] = '\0';
+    *index = findSnapshot(snapshot);
+    if (*index == -1) {
+        return -ENOENT;
+    }
+    if (!rest || !strcmp(rest, "/")) {
+        return SNAPSHOT_ROOT;
+    }
+    threadState()->root = super.snapshot[*index].root;
+    *path = rest;
+    return IN_VOLUME;
+}
+
+//lists /.snap or the directories of /.snap/name
+static int snapshotReaddir(int kind, int index, void *buf, fuse_fill_dir_t filler) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    int i;
+    if (kind == SNAPSHOT_LIST) {
+        for (i = 0; i < super.snapshots; i++) {
+            filler(buf, super.snapshot[i].name, NULL, 0);
+        }
+        return 0;
+    }
+    struct cs1550_root_directory *root = arenaAlloc(sizeof(struct cs1550_root_directory));
+    if (!root) {
+        return -ENOMEM;
+    }
+    FILE *file = openDisk();
+    if (!file || fseek(file, super.snapshot[index].root * BLOCK_SIZE, SEEK_SET) ||
+        !fread(root, sizeof(struct cs1550_root_directory), 1, file)) {
+        printf("\nerror reading snapshot %s\n", super.snapshot[index].name);
+        closeDisk(file);
+        return -EIO;
+    }
+    closeDisk(file);
+    for (i = 0; i < root->nDirectories; i++) {
+        filler(buf, root->directories[i].dname, NULL, 0);
+    }
+    return 0;
+}
+
+/*
+ * Takes a snapshot of the whole volume. Costs one block for the root and one
+ * per directory however much data there is.
+ */
+static int cs1550_snapshot(const char *name) {
+    if (name[0] == '\0' || strchr(name, '/')) {
+        return -EINVAL;
+    }
+    if (strlen(name) > MAX_FILENAME) {
+        return -ENAMETOOLONG;
+    }
+    if (findSnapshot(name) != -1) {
+        return -EEXIST;
+    }
+    if (super.snapshots == MAX_SNAPSHOTS) {
+        return -ENOSPC;
+    }
+
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_root_directory root;
+    struct cs1550_tables tables;
+    if (fseek(file, 0, SEEK_SET) || !fread(&root, sizeof(struct cs1550_root_directory), 1, file) ||
+        readTables(file, &tables)) {
+        printf("\nerror reading .disk for snapshot\n");
+        closeDisk(file);
+        return -EIO;
+    }
+
+    //everything is worked out in memory first, so a failure leaves no trace
+    struct cs1550_directory_entry *entries = arenaAlloc(root.nDirectories * sizeof(struct cs1550_directory_entry));
+    if (!entries) {
+        closeDisk(file);
+        return -ENOMEM;
+    }
+    long root_copy = allocateBlock(&tables.fat);
+    int d, i;
+    for (d = 0; d < root.nDirectories && root_copy != -1; d++) {
+        if (fseek(file, root.directories[d].nStartBlock * BLOCK_SIZE, SEEK_SET) ||
+            !fread(&entries[d], sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror reading directory %s for snapshot\n", root.directories[d].dname);
+            closeDisk(file);
+            return -EIO;
+        }
+        for (i = 0; i < entries[d].nFiles; i++) {
+            long head = entries[d].files[i].nStartBlock;
+            if (tables.unwritten.shares[head] == MAX_SHARES) {
+                closeDisk(file);
+                return -EMLINK;
+            }
+            tables.unwritten.shares[head]++;
+        }
+        int copy = allocateBlock(&tables.fat);
+        if (copy == -1) {
+            root_copy = -1;
+        }
+        root.directories[d].nStartBlock = copy;
+    }
+    if (root_copy == -1) {
+        printf("\nnot enough free blocks for a snapshot\n");
+        closeDisk(file);
+        return -ENOSPC;
+    }
+
+    for (d = 0; d < root.nDirectories; d++) {
+        if (fseek(file, root.directories[d].nStartBlock * BLOCK_SIZE, SEEK_SET) ||
+            !fwrite(&entries[d], sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror writing snapshot directory\n");
+            closeDisk(file);
+            return -EIO;
+        }
+    }
+    if (fseek(file, root_copy * BLOCK_SIZE, SEEK_SET) ||
+        !fwrite(&root, sizeof(struct cs1550_root_directory), 1, file) || writeTables(file, &tables)) {
+        printf("\nerror writing snapshot root\n");
+        closeDisk(file);
+        return -EIO;
+    }
+    strcpy(super.snapshot[super.snapshots].name, name);
+    super.snapshot[super.snapshots].root = root_copy;
+    super.snapshots++;
+    int res = writeSuperblock(file, &super);
+    closeDisk(file);
+    return res ? -EIO : 0;
+}
+
+//deletes a snapshot, freeing whatever only it still used
+static int cs1550_drop_snapshot(const char *name) {
+    int index = findSnapshot(name);
+    if (index == -1) {
+        return -ENOENT;
+    }
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_root_directory root;
+    struct cs1550_tables tables;
+    long root_copy = super.snapshot[index].root;
+    if (fseek(file, root_copy * BLOCK_SIZE, SEEK_SET) ||
+        !fread(&root, sizeof(struct cs1550_root_directory), 1, file) || readTables(file, &tables)) {
+        printf("\nerror reading snapshot %s\n", name);
+        closeDisk(file);
+        return -EIO;
+    }
+    int d, i;
+    for (d = 0; d < root.nDirectories; d++) {
+        struct cs1550_directory_entry entry;
+        if (fseek(file, root.directories[d].nStartBlock * BLOCK_SIZE, SEEK_SET) ||
+            !fread(&entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror reading snapshot directory %s\n", root.directories[d].dname);
+            closeDisk(file);
+            return -EIO;
+        }
+        for (i = 0; i < entry.nFiles; i++) {
+            releaseChain(&tables, entry.files[i].nStartBlock);
+        }
+        releaseChain(&tables, root.directories[d].nStartBlock);
+    }
+    releaseChain(&tables, root_copy);
+    if (writeTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    super.snapshots--;
+    memmove(&super.snapshot[index], &super.snapshot[index + 1],
+            (super.snapshots - index) * sizeof(struct cs1550_snapshot));
+    memset(&super.snapshot[super.snapshots], 0, sizeof(struct cs1550_snapshot));
+    int res = writeSuperblock(file, &super);
+    closeDisk(file);
+    return res ? -EIO : 0;
+}
+
+/*
+ * Clones and snapshots, e.g. through the cs1550ctl tool
+ */
+static int cs1550_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                        unsigned int flags, void *data) {
+    (void) arg;
+    (void) fi;
+    (void) flags;
+    struct cs1550_ioctl_name request;
+    memcpy(&request, data, sizeof(struct cs1550_ioctl_name));
+    request.name[sizeof(request.name) - 1] = '\0';
+
+    if (cmd == (int) CS1550_IOC_CLONE) {
+        return cs1550_clone(path, request.name);
+    } else if (cmd == (int) CS1550_IOC_SNAPSHOT) {
+        return cs1550_snapshot(request.name);
+    } else if (cmd == (int) CS1550_IOC_DROP_SNAPSHOT) {
+        return cs1550_drop_snapshot(request.name);
+    }
+    return -ENOTTY;
+}
+
+//directories only live in the root, so renaming one only rewrites the root
+//block; an empty directory at to is replaced
+static int renameDirectory(const char *from, const char *to) {
+    if (to[0] == '\0') {
+        return -EINVAL;
     }
-    if (!fwrite(fat, sizeof(struct cs_1550_fat), 1, file)) {
-        printf("\nerror writing fat to .disk\n");
-        fclose(file);
-        return -1;
+    if (strlen(to) > MAX_FILENAME) {
+        return -ENAMETOOLONG;
     }
-    int off = free_block * BLOCK_SIZE;
-    if (fseek(file, off, SEEK_SET)) {
-        printf("\nerror freeing block in disk\n");
-        fclose(file);
-        return -1;
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
     }
-    struct cs1550_disk_block *block = malloc(sizeof(cs1550_disk_block));
-    for (i = 0; i < MAX_DATA_IN_BLOCK; i++) {
-        block->data[i] = 0;
+    struct cs1550_root_directory root;
+    if (fseek(file, 0, SEEK_SET) || !fread(&root, sizeof(struct cs1550_root_directory), 1, file)) {
+        printf("\nerror reading root from .disk\n");
+        closeDisk(file);
+        return -EIO;
     }
-    if (!fwrite(block, sizeof(struct cs1550_file_directory), 1, file)) {
-        printf("error writing to .disk\n");
-        fclose(file);
-        return -1;
+    int i, index = -1, replaced = -1;
+    for (i = 0; i < root.nDirectories; i++) {
+        if (!strcmp(root.directories[i].dname, from)) {
+            index = i;
+        } else if (!strcmp(root.directories[i].dname, to)) {
+            replaced = i;
+        }
     }
-    entry->nFiles++;
-    off = dir * BLOCK_SIZE;
-    if (fseek(file, off, SEEK_SET)) {
-        printf("\n.disk error\n");
-        fclose(file);
-        return -1;
+    if (index == -1) {
+        closeDisk(file);
+        return -ENOENT;
     }
-    if (!fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
-        printf("\nerror writing directory to .disk\n");
-        fclose(file);
-        return -1;
+    long released = -1;
+    if (replaced != -1) {
+        struct cs1550_directory_entry entry;
+        released = root.directories[replaced].nStartBlock;
+        if (fseek(file, released * BLOCK_SIZE, SEEK_SET) ||
+            !fread(&entry, sizeof(struct cs1550_directory_entry), 1, file)) {
+            printf("\nerror reading directory %s from .disk\n", to);
+            closeDisk(file);
+            return -EIO;
+        }
+        if (entry.nFiles > 0) {
+            closeDisk(file);
+            return -ENOTEMPTY;
+        }
     }
 
-
-    fclose(file);
-
+    strcpy(root.directories[index].dname, to);
+    if (replaced != -1) {
+        root.nDirectories--;
+        memmove(&root.directories[replaced], &root.directories[replaced + 1],
+                (root.nDirectories - replaced) * sizeof(struct cs1550_directory));
+        memset(&root.directories[root.nDirectories], 0, sizeof(struct cs1550_directory));
+    }
+    if (fseek(file, 0, SEEK_SET) || !fwrite(&root, sizeof(struct cs1550_root_directory), 1, file)) {
+        printf("\nerror writing root to .disk\n");
+        closeDisk(file);
+        return -EIO;
+    }
+    if (released != -1) {
+        struct cs1550_tables tables;
+        if (readTables(file, &tables)) {
+            closeDisk(file);
+            return -EIO;
+        }
+        releaseChain(&tables, released);
+        if (writeTables(file, &tables)) {
+            closeDisk(file);
+            return -EIO;
+        }
+        super.directories--;
+    }
+    closeDisk(file);
     return 0;
 }
 
 /*
- * Deletes a file
- */
-static int cs1550_unlink(const char *path) {
-    (void) path;
-
-    return 0;
-}
-
-/* 
- * Read size bytes from file into buf starting from offset
- *
+ * Moves a file by moving its directory record, whatever its size; the data
+ * blocks aren't touched. A file already at to is replaced in the same write
+ * that puts the new one there, and its blocks are freed unless a clone or a
+ * snapshot still shares them.
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi) {
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
+static int cs1550_rename(const char *from, const char *to) {
     char directory[MAX_FILENAME + 1];
     char filename[MAX_FILENAME + 1];
     char extension[MAX_EXTENSION + 1];
-    format(path, directory, filename, extension);
-
-    //check to make sure path exists
-    struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
-    int location = findDirectory(directory, entry);
-    if (location == -1) {
-        printf("\npath doesnt exist\n");
-        return 0;
+    char to_directory[MAX_FILENAME + 1];
+    char to_filename[MAX_FILENAME + 1];
+    char to_extension[MAX_EXTENSION + 1];
+
+    //a path with one component is a directory
+    int from_file = strchr(from + 1, '/') != NULL;
+    int to_file = strchr(to + 1, '/') != NULL;
+    if (from_file != to_file) {
+        return from_file ? -EISDIR : -ENOTDIR;
     }
-    int i;
-    int file_location = -1;
-    size_t file_size = 0;
-    for (i = 0; i < entry->nFiles; i++) {
-        if (!strcmp(filename, entry->files[i].fname) && !strcmp(extension, entry->files[i].fext)) {
-            file_location = entry->files[i].nStartBlock;
-            file_size = entry->files[i].fsize;
-            break;
-        }
+    if (!from_file) {
+        return renameDirectory(from + 1, to + 1);
     }
-    if (file_location == -1) {
-        printf("\nfile does not exist in directory\n");
-        return 0;
+    int res = splitPath(from, directory, filename, extension);
+    if (!res) {
+        res = splitPath(to, to_directory, to_filename, to_extension);
+    }
+    if (res) {
+        return res;
     }
-    //check that size is > 0
 
-    if (size <= 0) {
-        printf("\nsize can;t be zero\n");
-        return 0;
+    struct cs1550_directory_entry *source = arenaAlloc(sizeof(struct cs1550_directory_entry));
+    if (!source) {
+        return -ENOMEM;
     }
-    //check that offset is <= to the file size
-    if (file_size < offset) {
-        printf("\noffset cant be greater than filezise\n");
-        return 0;
+    int source_location = findDirectory(directory, source);
+    if (source_location == -1) {
+        return -ENOENT;
     }
-    //read in data
-    if (file_size < (offset + size)) {
-        size = file_size - offset;
+    int index = findFile(source, filename, extension);
+    if (index == -1) {
+        return -ENOENT;
     }
-    FILE *file;
-    file = fopen(".disk", "rb");
-    if (!file) {
-        printf("\nerror opening .disk\n");
-        fclose(file);
-        return 0;
+    //within one directory both ends are the same block, written once
+    struct cs1550_directory_entry *dest = source;
+    int dest_location = source_location;
+    if (strcmp(directory, to_directory)) {
+        dest = arenaAlloc(sizeof(struct cs1550_directory_entry));
+        if (!dest) {
+            return -ENOMEM;
+        }
+        dest_location = findDirectory(to_directory, dest);
+        if (dest_location == -1) {
+            return -ENOENT;
+        }
     }
-    struct cs_1550_fat *fat = malloc(sizeof(struct cs_1550_fat));
-    if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
-        printf("\nerror seeking to fat on .disk\n");
-        fclose(file);
+    int replaced = findFile(dest, to_filename, to_extension);
+    if (dest == source && replaced == index) {
         return 0;
     }
-    if (!fread(fat, sizeof(struct cs_1550_fat), 1, file)) {
-        printf("\nerror reading fat from .disk\n");
-        fclose(file);
-        return 0;
+    if (replaced == -1 && dest != source && dest->nFiles >= (int) (MAX_FILES_IN_DIR)) {
+        return -ENOSPC;
     }
 
-    //set size and return, or error
-
+    struct cs1550_file_directory record = source->files[index];
+    strcpy(record.fname, to_filename);
+    strcpy(record.fext, to_extension);
+    long released = -1;
+    if (dest == source && replaced == -1) {
+        source->files[index] = record;
+    } else {
+        if (replaced == -1) {
+            replaced = dest->nFiles++;
+        } else {
+            released = dest->files[replaced].nStartBlock;
+        }
+        dest->files[replaced] = record;
+        source->nFiles--;
+        memmove(&source->files[index], &source->files[index + 1],
+                (source->nFiles - index) * sizeof(struct cs1550_file_directory));
+        memset(&source->files[source->nFiles], 0, sizeof(struct cs1550_file_directory));
+    }
 
-    while (offset > BLOCK_SIZE) {
-        offset -= BLOCK_SIZE;
-        if (fat->table[file_location] == -2) {
-            break;
+    FILE *file = openDisk();
+    if (!file) {
+        printf("\nerror opening .disk\n");
+        return -EIO;
+    }
+    struct cs1550_tables tables;
+    if (readTables(file, &tables)) {
+        closeDisk(file);
+        return -EIO;
+    }
+    //across directories the destination is written first, so a crash in
+    //between leaves the file in both rather than in neither. Until the
+    //source lets go its chain counts as shared, like a clone's, so that
+    //state is one fsck accepts instead of a cross-link.
+    int moving = dest != source;
+    long head = record.nStartBlock;
+    if (moving) {
+        if (tables.unwritten.shares[head] == MAX_SHARES) {
+            closeDisk(file);
+            return -EMLINK;
+        }
+        tables.unwritten.shares[head]++;
+        if (writeTables(file, &tables) || syncVolume(file)) {
+            closeDisk(file);
+            return -EIO;
         }
-        file_location = fat->table[file_location];
     }
-    int off = file_location * BLOCK_SIZE;
-    if (fseek(file, off, SEEK_SET)) {
-        printf("\nerror seeking to file location on disk\n");
-        fclose(file);
-        return 0;
+    if (fseek(file, dest_location * BLOCK_SIZE, SEEK_SET) ||
+        !fwrite(dest, sizeof(struct cs1550_directory_entry), 1, file) ||
+        (moving && (syncVolume(file) || fseek(file, source_location * BLOCK_SIZE, SEEK_SET) ||
+                    !fwrite(source, sizeof(struct cs1550_directory_entry), 1, file) || syncVolume(file)))) {
+        printf("\nerror writing directory to .disk\n");
+        closeDisk(file);
+        return -EIO;
     }
-    int count = 1;
-    if ((offset + size) > BLOCK_SIZE) {
-        count = (offset + size) / BLOCK_SIZE;
-        if (((offset + size) % BLOCK_SIZE) > 0) {
-            count++;
+    if (moving || released != -1) {
+        if (moving) {
+            tables.unwritten.shares[head]--;
+        }
+        if (released != -1) {
+            releaseChain(&tables, released);
+            super.files--;
+        }
+        if (writeTables(file, &tables)) {
+            closeDisk(file);
+            return -EIO;
         }
     }
-    struct cs1550_disk_block *block = malloc(sizeof(struct cs1550_disk_block));
-    if (!fread(block->data, MAX_DATA_IN_BLOCK, 1, file)) {
-        printf("\nerror reading disk block\n");
-        fclose(file);
-        return 0;
+    closeDisk(file);
+    return 0;
+}
+
+/*
+ * Called once the filesystem is mounted; loads the superblock and starts the
+ * defragmenter if asked to.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn) {
+    //let write_buf splice from /dev/fuse into .disk where we can
+    if (conn) {
+        conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
     }
-    if (count > 1) {
-        strncat(buf, &block->data[offset], MAX_DATA_IN_BLOCK);
-        size -= MAX_DATA_IN_BLOCK;
-        int readCount = 1;
-        while (readCount < count) {
-            int read_size = MAX_DATA_IN_BLOCK;
-            if (size < MAX_DATA_IN_BLOCK) {
-                read_size = size;
-            }
-            file_location = fat->table[file_location];
-            if (file_location == -2) {
-                printf("\nHit EOF before completing requested read\n");
-                break;
-            }
-            off = file_location * BLOCK_SIZE;
-            if (fseek(file, off, SEEK_SET)) {
-                printf("\nError on seeking to next disk block of file\n");
-                break;
-            }
-            if (!fread(block->data, read_size, 1, file)) {
-                printf("\nError on reading disk block\n");
-                break;
-            }
-            strncat(buf, &block->data[0], read_size);
-            readCount++;
-            size -= MAX_DATA_IN_BLOCK;
+    if (volume.members > 1) {
+        startWorkers(volume.members);
+    }
+    if (options.defrag_rate > 0) {
+        defrag_running = 1;
+        if (pthread_create(&defrag_thread, NULL, defragmenter, NULL)) {
+            printf("\ncouldn't start defragmenter\n");
+            defrag_running = 0;
         }
-    } else {
-        strncat(buf, &block->data[offset], size);
     }
-    size = strlen(buf);
-    strcat(buf, "\n");
+    return NULL;
+}
+
+static void cs1550_destroy(void *private_data) {
+    (void) private_data;
+    pthread_mutex_lock(&defrag_mutex);
+    int was_running = defrag_running;
+    defrag_running = 0;
+    pthread_cond_signal(&defrag_cond);
+    pthread_mutex_unlock(&defrag_mutex);
+    if (was_running) {
+        pthread_join(defrag_thread, NULL);
+    }
+    unmountSuperblock();
+}
 
-    size = 0;
+//the operations below just run the ones above under disk_lock, resolving
+//paths into snapshots for the ones that read and refusing the ones that write
 
-    return size;
+static int locked_getattr(const char *path, struct stat *stbuf) {
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_rdlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME) {
+        res = cs1550_getattr(path, stbuf);
+    } else if (res > 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        res = 0;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
 }
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi) {
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
-    char directory[MAX_FILENAME + 1];
-    char filename[MAX_FILENAME + 1];
-    char extension[MAX_EXTENSION + 1];
-    format(path, directory, filename, extension);
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_rdlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME) {
+        res = cs1550_readdir(path, buf, filler, offset, fi);
+    } else if (res > 0) {
+        res = snapshotReaddir(res, index, buf, filler);
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
+static int locked_mkdir(const char *path, mode_t mode) {
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_mkdir(path, mode);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    //check to make sure path exists
-    struct cs1550_directory_entry *entry = malloc(sizeof(struct cs1550_directory_entry));
-    int location = findDirectory(directory, entry);
-    if (location == -1) {
-        printf("\npath doesn't exist\n");
-        return 0;
+static int locked_mknod(const char *path, mode_t mode, dev_t dev) {
+    if (inSnapshot(path)) {
+        return -EROFS;
     }
-    //check that size is > 0
-    size_t file_size = 0;
-    int found_index = -1;
-    int found_location = -1;
-    int i = 0;
-    for (i = 0; i < entry->nFiles; i++) {
-        if (!strcmp(filename, entry->files[i].fname) && !strcmp(extension, entry->files[i].fext)) {
-            found_index = i;
-            found_location = entry->files[i].nStartBlock;
-            file_size = entry->files[i].fsize;
-            break;
-        }
+    if (arenaReset()) {
+        return -ENOMEM;
     }
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_mknod(path, mode, dev);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    if (file_size <= 0 || found_index == -1) {
-        printf("\nfile size must be nonzero");
-        return 0;
+static int locked_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_rdlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME) {
+        res = cs1550_read(path, buf, size, offset, fi);
+    } else if (res > 0) {
+        res = -EISDIR;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
+static int locked_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi) {
+    if (inSnapshot(path)) {
+        return -EROFS;
     }
-    //check that offset is <= to the file size
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_write(path, buf, size, offset, fi);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    if (offset > file_size) {
-        printf("\noffest can't be larger than file size");
-        return -EFBIG;
+static int locked_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi) {
+    if (inSnapshot(path)) {
+        return -EROFS;
     }
-    //write data
-    FILE *file;
-    file = fopen(".disk", "rb+");
-    if (!file) {
-        fclose(file);
-        printf("\ncouldn't open disk");
-        return 0;
+    if (arenaReset()) {
+        return -ENOMEM;
     }
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_write_buf(path, buf, offset, fi);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    //set size (should be same as input) and return, or error
+static int locked_fallocate(const char *path, int mode, off_t offset, off_t length,
+                            struct fuse_file_info *fi) {
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_fallocate(path, mode, offset, length, fi);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    struct cs_1550_fat *fat = malloc(sizeof(struct cs_1550_fat));
-    if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
-        printf("\nerror seeking fat on .disk\n");
-        fclose(file);
-        return 0;
+static int locked_getxattr(const char *path, const char *name, char *value, size_t size) {
+    if (arenaReset()) {
+        return -ENOMEM;
     }
-    if (!fread(fat, sizeof(struct cs_1550_fat), 1, file)) {
-        printf("\nerror reading fat on .disk\n");
-        fclose(file);
-        return 0;
+    pthread_rwlock_rdlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME) {
+        res = cs1550_getxattr(path, name, value, size);
+    } else if (res > 0) {
+        res = -ENODATA;
     }
-    int real_offset = offset;
-    while (real_offset > BLOCK_SIZE) {
-        real_offset -= BLOCK_SIZE;
-        if (fat->table[found_location] == -2) {
-            break;
-        }
-        found_location = fat->table[found_location];
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
+
+static int locked_statfs(const char *path, struct statvfs *stbuf) {
+    if (arenaReset()) {
+        return -ENOMEM;
     }
-    int off = found_location * BLOCK_SIZE;
-    if (fseek(file, off, SEEK_SET)) {
-        printf("\nerror seeking file location on .disk\n");
-        fclose(file);
-        return 0;
+    pthread_rwlock_rdlock(&disk_lock);
+    int res = cs1550_statfs(path, stbuf);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
+
+static int locked_listxattr(const char *path, char *list, size_t size) {
+    if (arenaReset()) {
+        return -ENOMEM;
     }
-    int num_blocks = 1;
-    if ((offset + size) > BLOCK_SIZE) {
-        num_blocks = (offset + size) / BLOCK_SIZE;
-        if (((offset + size) % BLOCK_SIZE) > 0) {
-            num_blocks++;
-        }
-    }
-    struct cs1550_disk_block *block = malloc(sizeof(struct cs1550_disk_block));
-    int blocks_written = 0;
-    int bytes_written = 0;
-    int bytes_remaining = size;
-    while (blocks_written < num_blocks) {
-        int write_size = MAX_DATA_IN_BLOCK;
-        if (bytes_remaining < MAX_DATA_IN_BLOCK) {
-            write_size = bytes_remaining;
-        }
-        if (!fread(block->data, MAX_DATA_IN_BLOCK, 1, file)) {
-            printf("\nerorr reading block from .disk\n");
-            fclose(file);
-            return 0;
-        }
-        if (blocks_written == 0) {
-            if ((write_size + offset) > MAX_DATA_IN_BLOCK) {
-                write_size = MAX_DATA_IN_BLOCK - offset;
-            }
-        } else {
-            real_offset = 0;
-        }
-        block->data[real_offset] = 0;
-        strncat(&block->data[real_offset], buf, write_size);
-        buf += write_size * sizeof(char);
-        bytes_written += write_size;
-        bytes_remaining -= write_size;
-        off = found_location * BLOCK_SIZE;
-        if (fseek(file, off, SEEK_SET)) {
-            printf("error seeking beginning of block\n");
-            return 0;
-        }
-        if (!fwrite(block->data, BLOCK_SIZE, 1, file)) {
-            printf("\nerror writing .disk\n");
-            return 0;
-        }
-        if (bytes_remaining) {
-            if (fat->table[found_location] != -2) {
-                found_location = fat->table[found_location];
-            } else {
-                int free_block = -1;
-                for (i = 0; i < MAX_FAT; i++) {
-                    if (fat->table[i] == (short) -1) {
-                        free_block = i;
-                        fat->table[found_location] = i;
-                        fat->table[i] = (short) -2;
-                        break;
-                    }
-                }
-                if (free_block == -1) {
-                    printf("\ndisk full\n");
-                    fclose(file);
-                    return bytes_written;
-                }
-                if (fseek(file, -sizeof(struct cs_1550_fat), SEEK_END)) {
-                    printf("\neroor seeking fat on .disk\n");
-                    fclose(file);
-                    return 0;
-                }
-                if (!fwrite(fat, sizeof(struct cs_1550_fat), 1, file)) {
-                    printf("\nerror writing fat to .disk\n");
-                    fclose(file);
-                    return 0;
-                }
-                found_location = free_block;
-            }
-            off = found_location * BLOCK_SIZE;
-            if (fseek(file, off, SEEK_SET)) {
-                printf("\nwrite erorr\n");
-                return bytes_written;
-            }
-        } else {
-            break;
-        }
-        blocks_written++;
+    pthread_rwlock_rdlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME) {
+        res = cs1550_listxattr(path, list, size);
+    } else if (res > 0) {
+        res = 0;
     }
-    if ((offset + size) > file_size) {
-        entry->files[found_index].fsize += (offset + size) - file_size;
-    } else if ((offset + size) < file_size) {
-        entry->files[found_index].fsize = offset + size;
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
+
+static int locked_rename(const char *from, const char *to) {
+    if (inSnapshot(from) || inSnapshot(to)) {
+        return -EROFS;
     }
-    if (file_size != entry->files[found_index].fsize) {
-        off = location * BLOCK_SIZE;
-        if (fseek(file, off, SEEK_SET)) {
-            printf("\nerror finding directory on .disk\n");
-            fclose(file);
-            return 0;
-        }
-        if (!fwrite(entry, sizeof(struct cs1550_directory_entry), 1, file)) {
-            printf("\nerror writing directory to .disk\n");
-            fclose(file);
-            return 0;
-        }
+    if (arenaReset()) {
+        return -ENOMEM;
     }
-    fclose(file);
+    pthread_rwlock_wrlock(&disk_lock);
+    int res = cs1550_rename(from, to);
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
+}
 
-    return bytes_written;
+//the source of a clone may be in a snapshot, the snapshot ioctls ignore path
+static int locked_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                        unsigned int flags, void *data) {
+    if (arenaReset()) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_wrlock(&disk_lock);
+    int index;
+    int res = enterSnapshot(&path, &index);
+    if (res == IN_VOLUME || cmd != (int) CS1550_IOC_CLONE) {
+        res = cs1550_ioctl(path, cmd, arg, fi, flags, data);
+    } else if (res > 0) {
+        res = -EISDIR;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return res;
 }
 
+#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_options, p), v }
+
+static struct fuse_opt cs1550_opts[] = {
+        CS1550_OPT("compress", compress, 1),
+        CS1550_OPT("defrag=%u", defrag_rate, 0),
+        CS1550_OPT("images=%s", images, 0),
+        CS1550_OPT("stripe=%u", stripe, 0),
+        CS1550_OPT("direct", direct, 1),
+        CS1550_OPT("cache=%u", cache_pages, 0),
+        FUSE_OPT_END
+};
+
 /******************************************************************************
  *
  *  DO NOT MODIFY ANYTHING BELOW THIS LINE
@@ -906,20 +3557,49 @@ static int cs1550_flush(const char *path, struct fuse_file_info *fi) {
 
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
-        .getattr    = cs1550_getattr,
-        .readdir    = cs1550_readdir,
-        .mkdir    = cs1550_mkdir,
+        .getattr    = locked_getattr,
+        .readdir    = locked_readdir,
+        .mkdir    = locked_mkdir,
         .rmdir = cs1550_rmdir,
-        .read    = cs1550_read,
-        .write    = cs1550_write,
-        .mknod    = cs1550_mknod,
+        .read    = locked_read,
+        .write    = locked_write,
+        .write_buf = locked_write_buf,
+        .mknod    = locked_mknod,
+        .rename = locked_rename,
         .unlink = cs1550_unlink,
         .truncate = cs1550_truncate,
         .flush = cs1550_flush,
         .open    = cs1550_open,
+        .fallocate = locked_fallocate,
+        .getxattr = locked_getxattr,
+        .listxattr = locked_listxattr,
+        .statfs = locked_statfs,
+        .ioctl = locked_ioctl,
+        .init = cs1550_init,
+        .destroy = cs1550_destroy,
 };
 
-//Don't change this.
 int main(int argc, char *argv[]) {
-    return fuse_main(argc, argv, &hello_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1) {
+        return 1;
+    }
+    //open the images before fuse_main, which may chdir away from them
+    if (openVolume(options.images, options.stripe, options.direct)) {
+        return 1;
+    }
+    //refuse to mount rather than serve counts that couldn't be loaded or
+    //rebuilt; init can't fail the mount, so this happens here
+    if (mountSuperblock()) {
+        printf("\ncan't load or rebuild the superblock, run fsck\n");
+        return 1;
+    }
+    //libfuse would splice write_buf's fd pieces with unaligned I/O the
+    //O_DIRECT images refuse, so go through write instead
+    if (options.direct) {
+        hello_oper.write_buf = NULL;
+    }
+    int ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+/*
+ * On-disk format of the cs1550 filesystem, shared by the FUSE driver and the
+ * mkfs and fsck tools.
+ */
+
+#ifndef CS1550_H
+#define CS1550_H
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+//size of a disk block
+#define    BLOCK_SIZE 512
+
+//we'll use 8.3 filenames
+#define    MAX_FILENAME 8
+#define    MAX_EXTENSION 3
+
+//How many files can there be in one directory?
+#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+
+//The attribute packed means to not align these things
+struct cs1550_directory_entry {
+    int nFiles;    //How many files are in this directory.
+    //Needs to be less than MAX_FILES_IN_DIR
+
+    struct cs1550_file_directory {
+        char fname[MAX_FILENAME + 1];    //filename (plus space for nul)
+        char fext[MAX_EXTENSION + 1];    //extension (plus space for nul)
+        size_t fsize;                    //file size
+        long nStartBlock;                //where the first block is on disk
+    } __attribute__((packed)) files[MAX_FILES_IN_DIR];    //There is an array of these
+
+    //This is some space to get this to be exactly the size of the disk block.
+    //Don't use it for anything.
+    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+};
+
+typedef struct cs1550_root_directory cs1550_root_directory;
+
+#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+
+struct cs1550_root_directory {
+    int nDirectories;    //How many subdirectories are in the root
+    //Needs to be less than MAX_DIRS_IN_ROOT
+    struct cs1550_directory {
+        char dname[MAX_FILENAME + 1];    //directory name (plus space for nul)
+        long nStartBlock;                //where the directory block is on disk
+    } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];    //There is an array of these
+
+    //This is some space to get this to be exactly the size of the disk block.
+    //Don't use it for anything.
+    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+};
+
+
+typedef struct cs1550_directory_entry cs1550_directory_entry;
+
+//How much data can one block hold?
+#define    MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+
+struct cs1550_disk_block {
+    //All of the space in the block can be used for actual data
+    //storage.
+    char data[MAX_DATA_IN_BLOCK];
+};
+
+typedef struct cs1550_disk_block cs1550_disk_block;
+
+#define MAX_FAT (BLOCK_SIZE/sizeof(short))
+
+struct cs_1550_fat {
+    short table[MAX_FAT];
+};
+
+//One bit per FAT slot, kept in the block just before the FAT. A set bit means
+//the block belongs to a file (a hole or an fallocate reservation) but has
+//never been written, so it reads back as zeros without touching the disk.
+//The rest of the block counts each slot's extra references: how many FAT
+//links and start blocks point at it beyond the first, because a clone or a
+//snapshot shares it. Volumes from before cloning have 0 everywhere, which
+//is right for them.
+struct cs1550_unwritten_map {
+    unsigned char bits[MAX_FAT / 8];
+    unsigned char shares[MAX_FAT];
+    unsigned char padding[BLOCK_SIZE - MAX_FAT / 8 - MAX_FAT];
+};
+
+#define MAX_SHARES 255
+
+//Stored length of each FAT slot's data, kept in the block before the
+//unwritten map. 0 means the block holds its 512 bytes as is; anything else is
+//the size of the compressed extent at the start of the block.
+struct cs1550_extent_map {
+    unsigned short length[MAX_FAT];
+};
+
+//The per-block tables live back to back at the end of .disk in this order,
+//so they can be loaded and stored with one seek.
+struct cs1550_tables {
+    struct cs1550_extent_map extents;
+    struct cs1550_unwritten_map unwritten;
+    struct cs_1550_fat fat;
+};
+
+#define TABLES_OFFSET (-(long) sizeof(struct cs1550_tables))
+
+#define CS1550_MAGIC 0x30353531    //"1550" on disk
+#define MAX_SNAPSHOTS 8
+#define CS1550_VERSION 1
+
+//Geometry and counters, kept in the block in front of the tables. The counts
+//are only trusted at mount if the last unmount was clean; while mounted the
+//in-memory copy is the live one and the on-disk copy is marked dirty.
+struct cs1550_superblock {
+    int magic;
+    int version;
+    int block_size;
+    long total_blocks;    //size of the volume in blocks
+    int fat_entries;      //how many of those the FAT can address
+    int free_blocks;
+    int directories;
+    int files;
+    int clean;            //set on unmount, cleared while mounted
+    int members;          //image files the volume is striped over, 0 if never recorded
+    int stripe;           //blocks per stripe unit
+    int snapshots;
+    struct cs1550_snapshot {
+        char name[MAX_FILENAME + 1];
+        long root;        //copy of the root directory as it was when the snapshot was taken
+    } __attribute__((packed)) snapshot[MAX_SNAPSHOTS];
+
+    char padding[BLOCK_SIZE - 11 * sizeof(int) - sizeof(long) - MAX_SNAPSHOTS * sizeof(struct cs1550_snapshot)];
+} __attribute__((packed));
+
+#define SUPERBLOCK_OFFSET (TABLES_OFFSET - (long) sizeof(struct cs1550_superblock))
+
+//blocks at the end of .disk taken by the superblock and the tables
+#define METADATA_BLOCKS ((sizeof(struct cs1550_superblock) + sizeof(struct cs1550_tables)) / BLOCK_SIZE)
+
+//A volume can be striped over several image files of the same size. The
+//volume is cut into stripe units of stripe blocks that go to the members
+//round robin, so unit u is unit u / members of member u % members. The
+//metadata is still at the end of the volume, wherever that lands.
+#define MAX_MEMBERS 8
+#define DEFAULT_STRIPE 16
+
+/*
+ * Maps a byte of the volume to its member and position there. Returns how
+ * many bytes from pos on are contiguous in that member.
+ */
+static inline size_t stripeLocate(off_t pos, int members, int stripe, int *member, off_t *member_pos) {
+    off_t unit_size = (off_t) stripe * BLOCK_SIZE;
+    off_t unit = pos / unit_size;
+    *member = unit % members;
+    *member_pos = unit / members * unit_size + pos % unit_size;
+    return unit_size - pos % unit_size;
+}
+
+//Volume size for members of member_size bytes. A single image is used whole;
+//striped members are cut down to whole stripe units.
+static inline off_t stripedSize(off_t member_size, int members, int stripe) {
+    off_t unit_size = (off_t) stripe * BLOCK_SIZE;
+    if (members == 1) {
+        return member_size;
+    }
+    return member_size / unit_size * unit_size * members;
+}
+
+//ioctls taken by any file in the mount, with a path or snapshot name as the
+//argument. CLONE makes name ("/dir/file.ext") a copy of the file the ioctl
+//is issued on, sharing its blocks until either is written. SNAPSHOT takes a
+//read-only copy of the whole volume that shows up under /.snap/name, and
+//DROP_SNAPSHOT deletes one.
+struct cs1550_ioctl_name {
+    char name[64];
+};
+
+#define CS1550_IOC_CLONE _IOW('c', 1, struct cs1550_ioctl_name)
+#define CS1550_IOC_SNAPSHOT _IOW('c', 2, struct cs1550_ioctl_name)
+#define CS1550_IOC_DROP_SNAPSHOT _IOW('c', 3, struct cs1550_ioctl_name)
+
+#define IS_UNWRITTEN(map, block) ((map)->bits[(block) / 8] & (1 << ((block) % 8)))
+#define SET_UNWRITTEN(map, block) ((map)->bits[(block) / 8] |= (1 << ((block) % 8)))
+#define CLEAR_UNWRITTEN(map, block) ((map)->bits[(block) / 8] &= ~(1 << ((block) % 8)))
+
+#endif
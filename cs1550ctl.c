@@ -0,0 +1,55 @@
+/*
+ * Clones files and manages snapshots on a mounted cs1550 filesystem.
+ *
+ * usage: cs1550ctl clone file /dir/file.ext
+ *        cs1550ctl snapshot mountpoint name
+ *        cs1550ctl drop mountpoint name
+ *
+ * clone makes /dir/file.ext (a path inside the mount) a copy of file that
+ * shares its blocks; file may be in a snapshot. snapshot shows the volume as
+ * it is now under mountpoint/.snap/name until it's dropped.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+int main(int argc, char *argv[]) {
+    unsigned long cmd = 0;
+    if (argc == 4 && !strcmp(argv[1], "clone")) {
+        cmd = CS1550_IOC_CLONE;
+    } else if (argc == 4 && !strcmp(argv[1], "snapshot")) {
+        cmd = CS1550_IOC_SNAPSHOT;
+    } else if (argc == 4 && !strcmp(argv[1], "drop")) {
+        cmd = CS1550_IOC_DROP_SNAPSHOT;
+    } else {
+        fprintf(stderr, "usage: %s clone file /dir/file.ext\n"
+                        "       %s snapshot|drop mountpoint name\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    struct cs1550_ioctl_name request;
+    memset(&request, 0, sizeof(struct cs1550_ioctl_name));
+    if (strlen(argv[3]) >= sizeof(request.name)) {
+        fprintf(stderr, "%s: %s is too long\n", argv[0], argv[3]);
+        return 1;
+    }
+    strcpy(request.name, argv[3]);
+
+    int fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (ioctl(fd, cmd, &request)) {
+        perror(argv[3]);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * Checks a cs1550 filesystem image for consistency.
+ *
+ * usage: fsck [-y] [-j threads] [-s stripe] [image...]
+ *
+ * Directory blocks, the live ones and those of every snapshot, are read
+ * first; then the files' chains are checked in parallel, as many at a time
+ * as there are threads. Every block a directory or a file's chain reaches is marked in a
+ * shared bitmap, and every directory entry, start block and FAT link counts
+ * a reference to the block it points at. A block with more references than
+ * its share count allows for is cross-linked; one with fewer has a share
+ * count that's too high and would never be freed. Blocks the FAT has in use
+ * that nothing reaches are leaked. With -y leaked blocks are freed, share
+ * counts lowered and the superblock counts rewritten; everything else is
+ * only reported.
+ *
+ * Several images are checked as one volume striped over them, as mkfs made it.
+ *
+ * Exits as fsck(8) does: 0 clean, 1 errors fixed, 4 errors left, 8 couldn't
+ * check.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+#define SNAPSHOT_LABEL ".snap/"
+
+static int fds[MAX_MEMBERS];
+static int members = 0;
+static int stripe = DEFAULT_STRIPE;
+static off_t volume_size;
+static struct cs1550_root_directory root;
+static struct cs1550_tables tables;
+static struct cs1550_superblock super;
+
+//one bit per FAT slot, set once anything reaches the block
+static unsigned long reached[(MAX_FAT + 63) / 64];
+//directory entries, start blocks and FAT links pointing at each slot
+static unsigned short refs[MAX_FAT];
+
+//the directory blocks to check, live and from snapshots
+static struct directory {
+    char name[sizeof(SNAPSHOT_LABEL) + 2 * MAX_FILENAME + 2];
+    long block;
+    int live;             //counts towards the superblock's files
+    struct cs1550_directory_entry entry;
+} directories[(MAX_SNAPSHOTS + 1) * MAX_DIRS_IN_ROOT];
+static int directory_count = 0;
+
+//the files in them, which the threads take one at a time
+static struct work {
+    struct directory *dir;
+    struct cs1550_file_directory *file;
+} *work;
+static int work_items = 0;
+static int next_work = 0;
+static int files = 0;
+static int errors = 0;
+
+static void problem(const char *fmt, ...) {
+    va_list args;
+    char line[256];
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    printf("%s\n", line);
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void reach(long block) {
+    __atomic_fetch_or(&reached[block / 64], 1UL << (block % 64), __ATOMIC_RELAXED);
+}
+
+static int isReached(long block) {
+    return (reached[block / 64] & (1UL << (block % 64))) != 0;
+}
+
+static void reference(long block) {
+    __atomic_add_fetch(&refs[block], 1, __ATOMIC_RELAXED);
+}
+
+//block 0 is the root, everything else the FAT addresses is fair game
+static int validBlock(long block) {
+    return block > 0 && block < (long) MAX_FAT;
+}
+
+//reads or writes size bytes at pos of the volume, following the stripes
+static int volumeIO(void *data, size_t size, off_t pos, int write) {
+    char *bytes = data;
+    while (size > 0) {
+        int member;
+        off_t member_pos;
+        size_t length = stripeLocate(pos, members, stripe, &member, &member_pos);
+        if (length > size) {
+            length = size;
+        }
+        ssize_t res = write ? pwrite(fds[member], bytes, length, member_pos) :
+                      pread(fds[member], bytes, length, member_pos);
+        if (res <= 0) {
+            return -1;
+        }
+        bytes += res;
+        pos += res;
+        size -= res;
+    }
+    return 0;
+}
+
+static int readBlock(long block, void *data) {
+    return volumeIO(data, BLOCK_SIZE, (off_t) block * BLOCK_SIZE, 0);
+}
+
+static void checkFile(const char *dname, struct cs1550_file_directory *file) {
+    unsigned char seen[MAX_FAT];
+    long block = file->nStartBlock;
+    long length = 0;
+
+    memset(seen, 0, sizeof(seen));
+    if (!validBlock(block)) {
+        problem("%s/%s.%s: start block %ld out of range", dname, file->fname, file->fext, block);
+        return;
+    }
+    reference(block);
+    while (1) {
+        if (seen[block]) {
+            problem("%s/%s.%s: chain loops back to block %ld", dname, file->fname, file->fext, block);
+            break;
+        }
+        seen[block] = 1;
+        length++;
+        if (tables.fat.table[block] == (short) -1) {
+            problem("%s/%s.%s: chain runs into free block %ld", dname, file->fname, file->fext, block);
+            break;
+        }
+        reach(block);
+        if (tables.extents.length[block] >= BLOCK_SIZE) {
+            problem("%s/%s.%s: block %ld has extent length %d", dname, file->fname, file->fext, block,
+                    tables.extents.length[block]);
+        } else if (tables.extents.length[block] && IS_UNWRITTEN(&tables.unwritten, block)) {
+            problem("%s/%s.%s: block %ld is both unwritten and compressed", dname, file->fname, file->fext,
+                    block);
+        }
+
+        short next = tables.fat.table[block];
+        if (next == (short) -2) {
+            break;
+        }
+        if (!validBlock(next)) {
+            problem("%s/%s.%s: block %ld links to %d", dname, file->fname, file->fext, block, next);
+            break;
+        }
+        block = next;
+    }
+
+    //a chain may run past the size (fallocate -n), never short of it
+    long needed = file->fsize ? (long) ((file->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+    if (length < needed) {
+        problem("%s/%s.%s: size %zu needs %ld blocks, chain has %ld", dname, file->fname, file->fext,
+                file->fsize, needed, length);
+    }
+}
+
+//reads and checks every directory block, queueing the files in it
+static void loadDirectories(void) {
+    int d, i, j;
+    work = malloc((size_t) directory_count * MAX_FILES_IN_DIR * sizeof(struct work));
+    for (d = 0; d < directory_count; d++) {
+        struct directory *dir = &directories[d];
+        struct cs1550_directory_entry *entry = &dir->entry;
+        if (readBlock(dir->block, entry)) {
+            problem("%s: can't read directory block %ld", dir->name, dir->block);
+            continue;
+        }
+        if (entry->nFiles < 0 || entry->nFiles > (int) (MAX_FILES_IN_DIR)) {
+            problem("%s: bad file count %d", dir->name, entry->nFiles);
+            continue;
+        }
+        for (i = 0; i < entry->nFiles; i++) {
+            struct cs1550_file_directory *file = &entry->files[i];
+            if (!memchr(file->fname, '\0', sizeof(file->fname)) || !memchr(file->fext, '\0', sizeof(file->fext))) {
+                problem("%s: entry %d has an unterminated name", dir->name, i);
+                continue;
+            }
+            for (j = 0; j < i; j++) {
+                if (!strcmp(file->fname, entry->files[j].fname) && !strcmp(file->fext, entry->files[j].fext)) {
+                    problem("%s/%s.%s: listed twice", dir->name, file->fname, file->fext);
+                }
+            }
+            work[work_items].dir = dir;
+            work[work_items].file = file;
+            work_items++;
+        }
+        if (dir->live) {
+            files += entry->nFiles;
+        }
+    }
+}
+
+static void *checkFiles(void *arg) {
+    (void) arg;
+    int i;
+    while ((i = __atomic_fetch_add(&next_work, 1, __ATOMIC_RELAXED)) < work_items) {
+        checkFile(work[i].dir->name, work[i].file);
+    }
+    return NULL;
+}
+
+//checks a root directory, the live one or a snapshot's, and queues its
+//directories; label goes in front of their names
+static void checkRoot(struct cs1550_root_directory *dirs, const char *label, int live) {
+    if (dirs->nDirectories < 0 || dirs->nDirectories > (int) (MAX_DIRS_IN_ROOT)) {
+        problem("%sroot: bad directory count %d", label, dirs->nDirectories);
+        dirs->nDirectories = 0;
+    }
+    int i, j;
+    for (i = 0; i < dirs->nDirectories; i++) {
+        struct cs1550_directory *dir = &dirs->directories[i];
+        if (!memchr(dir->dname, '\0', sizeof(dir->dname))) {
+            problem("%sroot: entry %d has an unterminated name", label, i);
+            dir->dname[MAX_FILENAME] = '\0';
+        }
+        for (j = 0; j < i; j++) {
+            if (!strcmp(dir->dname, dirs->directories[j].dname)) {
+                problem("%sroot: %s listed twice", label, dir->dname);
+            }
+        }
+        if (!validBlock(dir->nStartBlock)) {
+            problem("%s%s: directory block %ld out of range", label, dir->dname, dir->nStartBlock);
+            continue;
+        }
+        reach(dir->nStartBlock);
+        reference(dir->nStartBlock);
+        if (tables.fat.table[dir->nStartBlock] != (short) -2) {
+            problem("%s%s: FAT entry for directory block %ld is %d", label, dir->dname, dir->nStartBlock,
+                    tables.fat.table[dir->nStartBlock]);
+        }
+        struct directory *item = &directories[directory_count++];
+        snprintf(item->name, sizeof(item->name), "%s%s", label, dir->dname);
+        item->block = dir->nStartBlock;
+        item->live = live;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *default_image = ".disk";
+    const char **images = &default_image;
+    int count = 1;
+    int repair = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "yj:s:")) != -1) {
+        if (opt == 'y') {
+            repair = 1;
+        } else if (opt == 'j') {
+            threads = atol(optarg);
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            stripe = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-y] [-j threads] [-s stripe] [image...]\n", argv[0]);
+            return 8;
+        }
+    }
+    if (optind < argc) {
+        images = (const char **) &argv[optind];
+        count = argc - optind;
+    }
+    if (count > MAX_MEMBERS) {
+        fprintf(stderr, "%s: can't stripe over more than %d images\n", argv[0], MAX_MEMBERS);
+        return 8;
+    }
+    const char *image = images[0];
+
+    off_t member_size = -1;
+    for (members = 0; members < count; members++) {
+        struct stat st;
+        fds[members] = open(images[members], repair ? O_RDWR : O_RDONLY);
+        if (fds[members] < 0 || fstat(fds[members], &st)) {
+            perror(images[members]);
+            return 8;
+        }
+        if (member_size == -1 || st.st_size < member_size) {
+            member_size = st.st_size;
+        }
+    }
+    volume_size = stripedSize(member_size, members, stripe);
+    if (volume_size < (off_t) ((MAX_FAT + METADATA_BLOCKS) * BLOCK_SIZE)) {
+        fprintf(stderr, "%s: too small to hold a filesystem\n", image);
+        return 8;
+    }
+    if (readBlock(0, &root) ||
+        volumeIO(&tables, sizeof(tables), volume_size + TABLES_OFFSET, 0) ||
+        volumeIO(&super, sizeof(super), volume_size + SUPERBLOCK_OFFSET, 0)) {
+        fprintf(stderr, "%s: %s\n", image, strerror(errno));
+        return 8;
+    }
+    if (super.magic == CS1550_MAGIC && super.members &&
+        (super.members != members || (members > 1 && super.stripe != stripe))) {
+        fprintf(stderr, "%s: made over %d images with %d block stripes\n", image, super.members, super.stripe);
+        return 8;
+    }
+
+    if (tables.fat.table[0] == 0 && root.nDirectories == 0) {
+        printf("%s: empty, FAT not initialised yet\n", image);
+        return 0;
+    }
+    if (tables.fat.table[0] != (short) -2) {
+        problem("FAT entry for the root is %d", tables.fat.table[0]);
+    }
+    reach(0);
+    reference(0);
+    checkRoot(&root, "", 1);
+
+    int i;
+    if (super.magic == CS1550_MAGIC && (super.snapshots < 0 || super.snapshots > MAX_SNAPSHOTS)) {
+        problem("superblock: bad snapshot count %d", super.snapshots);
+        super.snapshots = 0;
+    }
+    for (i = 0; super.magic == CS1550_MAGIC && i < super.snapshots; i++) {
+        struct cs1550_snapshot *snapshot = &super.snapshot[i];
+        struct cs1550_root_directory copy;
+        char label[sizeof(SNAPSHOT_LABEL) + MAX_FILENAME + 1];
+        snapshot->name[MAX_FILENAME] = '\0';
+        snprintf(label, sizeof(label), SNAPSHOT_LABEL "%s/", snapshot->name);
+        if (!validBlock(snapshot->root) || readBlock(snapshot->root, &copy)) {
+            problem("%sroot: can't read block %ld", label, snapshot->root);
+            continue;
+        }
+        reach(snapshot->root);
+        reference(snapshot->root);
+        checkRoot(&copy, label, 0);
+    }
+
+    loadDirectories();
+    if (!work) {
+        fprintf(stderr, "%s: out of memory\n", image);
+        return 8;
+    }
+    if (threads > work_items) {
+        threads = work_items;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    long started = 0;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, checkFiles, NULL)) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        checkFiles(NULL);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(work);
+
+    //links out of blocks nothing reaches don't count, those blocks are leaked
+    for (i = 0; i < (int) MAX_FAT; i++) {
+        if (isReached(i) && validBlock(tables.fat.table[i])) {
+            refs[tables.fat.table[i]]++;
+        }
+    }
+
+    int fixable = 0, free_blocks = 0;
+    for (i = 1; i < (int) MAX_FAT; i++) {
+        int recorded = tables.unwritten.shares[i] + 1;
+        if (tables.fat.table[i] == (short) -1) {
+            free_blocks++;
+            if (tables.unwritten.shares[i]) {
+                problem("free block %d has share count %d", i, tables.unwritten.shares[i]);
+                fixable++;
+                if (repair) {
+                    tables.unwritten.shares[i] = 0;
+                }
+            }
+        } else if (!isReached(i)) {
+            problem("block %d is in use but belongs to nothing", i);
+            fixable++;
+            if (repair) {
+                tables.fat.table[i] = (short) -1;
+                tables.extents.length[i] = 0;
+                tables.unwritten.shares[i] = 0;
+                CLEAR_UNWRITTEN(&tables.unwritten, i);
+                free_blocks++;
+            }
+        } else if (refs[i] > recorded) {
+            problem("block %d is cross-linked: %d references, share count allows %d", i, refs[i], recorded);
+        } else if (refs[i] < recorded) {
+            problem("block %d has share count %d but only %d references", i, recorded - 1, refs[i]);
+            fixable++;
+            if (repair) {
+                tables.unwritten.shares[i] = refs[i] - 1;
+            }
+        }
+    }
+
+    if (super.magic != CS1550_MAGIC) {
+        printf("no superblock, counts will be built at the next mount\n");
+    } else if (super.clean && (super.free_blocks != free_blocks || super.directories != root.nDirectories ||
+                               super.files != files)) {
+        problem("superblock counts %d free, %d directories, %d files; found %d, %d, %d",
+                super.free_blocks, super.directories, super.files, free_blocks, root.nDirectories, files);
+        fixable++;
+        super.free_blocks = free_blocks;
+        super.directories = root.nDirectories;
+        super.files = files;
+    }
+
+    if (repair && fixable) {
+        if (volumeIO(&tables, sizeof(tables), volume_size + TABLES_OFFSET, 1) ||
+            (super.magic == CS1550_MAGIC &&
+             volumeIO(&super, sizeof(super), volume_size + SUPERBLOCK_OFFSET, 1))) {
+            fprintf(stderr, "%s: %s\n", image, strerror(errno));
+            return 8;
+        }
+        for (i = 0; i < members; i++) {
+            if (fsync(fds[i])) {
+                fprintf(stderr, "%s: %s\n", images[i], strerror(errno));
+                return 8;
+            }
+        }
+    }
+    for (i = 0; i < members; i++) {
+        close(fds[i]);
+    }
+
+    printf("%s: %d directories, %d files, %d free blocks, %d problems\n", image, root.nDirectories, files,
+           free_blocks, errors);
+    if (errors == 0) {
+        return 0;
+    }
+    return repair && errors == fixable ? 1 : 4;
+}
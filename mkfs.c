@@ -0,0 +1,137 @@
+/*
+ * Creates an empty cs1550 filesystem image.
+ *
+ * usage: mkfs [-b blocks] [-s stripe] [image...]
+ *
+ * The image defaults to .disk in the current directory and 10240 blocks
+ * (5MB). The root directory goes in block 0, the superblock and the per-block
+ * tables in the last blocks of the volume. Given several images, the volume
+ * is striped over them in units of stripe blocks and each image gets an equal
+ * share, rounded up to whole stripe units.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+#define DEFAULT_BLOCKS 10240
+
+//writes size bytes at pos of the volume, following the stripes
+static int writeVolume(FILE **files, int members, int stripe, off_t pos, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        int member;
+        off_t member_pos;
+        size_t length = stripeLocate(pos, members, stripe, &member, &member_pos);
+        if (length > size) {
+            length = size;
+        }
+        if (fseek(files[member], member_pos, SEEK_SET) || !fwrite(bytes, length, 1, files[member])) {
+            return -1;
+        }
+        bytes += length;
+        pos += length;
+        size -= length;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    long blocks = DEFAULT_BLOCKS;
+    int stripe = DEFAULT_STRIPE;
+    const char *default_image = ".disk";
+    const char **images = &default_image;
+    int members = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+        if (opt == 'b') {
+            blocks = atol(optarg);
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            stripe = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-b blocks] [-s stripe] [image...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        images = (const char **) &argv[optind];
+        members = argc - optind;
+    }
+    if (members > MAX_MEMBERS) {
+        fprintf(stderr, "%s: can't stripe over more than %d images\n", argv[0], MAX_MEMBERS);
+        return 1;
+    }
+    //the FAT has to be able to address every block it hands out without
+    //running into the metadata at the end
+    if (blocks < (long) (MAX_FAT + METADATA_BLOCKS)) {
+        fprintf(stderr, "%s: need at least %ld blocks\n", argv[0], (long) (MAX_FAT + METADATA_BLOCKS));
+        return 1;
+    }
+    long member_blocks = blocks;
+    if (members > 1) {
+        long units = (blocks + (long) stripe * members - 1) / ((long) stripe * members);
+        member_blocks = units * stripe;
+        blocks = member_blocks * members;
+    }
+
+    FILE *files[MAX_MEMBERS];
+    struct cs1550_disk_block zero;
+    memset(&zero, 0, sizeof(struct cs1550_disk_block));
+    int m;
+    long i;
+    for (m = 0; m < members; m++) {
+        files[m] = fopen(images[m], "wb");
+        if (!files[m]) {
+            perror(images[m]);
+            return 1;
+        }
+        for (i = 0; i < member_blocks; i++) {
+            if (!fwrite(&zero, sizeof(struct cs1550_disk_block), 1, files[m])) {
+                perror(images[m]);
+                return 1;
+            }
+        }
+    }
+
+    struct cs1550_tables tables;
+    memset(&tables, 0, sizeof(struct cs1550_tables));
+    for (i = 0; i < (long) MAX_FAT; i++) {
+        tables.fat.table[i] = (short) -1;
+    }
+    tables.fat.table[0] = (short) -2;    //root directory
+
+    struct cs1550_superblock super;
+    memset(&super, 0, sizeof(struct cs1550_superblock));
+    super.magic = CS1550_MAGIC;
+    super.version = CS1550_VERSION;
+    super.block_size = BLOCK_SIZE;
+    super.total_blocks = blocks;
+    super.fat_entries = MAX_FAT;
+    super.free_blocks = MAX_FAT - 1;
+    super.members = members;
+    super.stripe = stripe;
+    super.clean = 1;
+
+    off_t size = (off_t) blocks * BLOCK_SIZE;
+    if (writeVolume(files, members, stripe, size + SUPERBLOCK_OFFSET, &super, sizeof(struct cs1550_superblock)) ||
+        writeVolume(files, members, stripe, size + TABLES_OFFSET, &tables, sizeof(struct cs1550_tables))) {
+        perror(argv[0]);
+        return 1;
+    }
+    for (m = 0; m < members; m++) {
+        if (fclose(files[m])) {
+            perror(images[m]);
+            return 1;
+        }
+    }
+
+    if (members > 1) {
+        printf("%d images, %d block stripes: ", members, stripe);
+    }
+    printf("%ld blocks of %d bytes, %d usable\n", blocks, BLOCK_SIZE, (int) MAX_FAT - 1);
+    return 0;
+}
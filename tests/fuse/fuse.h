@@ -0,0 +1,164 @@
+/*
+ * Stand-in for the parts of libfuse 2.9's <fuse.h> that cs1550.c uses, so
+ * tests/harness.c can run the filesystem's operations without libfuse or a
+ * mount. The layouts match libfuse 2.9 for FUSE_USE_VERSION 26.
+ */
+
+#ifndef CS1550_TEST_FUSE_H
+#define CS1550_TEST_FUSE_H
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <utime.h>
+
+struct fuse_file_info {
+    int flags;
+    unsigned long fh_old;
+    int writepage;
+    unsigned int direct_io : 1;
+    unsigned int keep_cache : 1;
+    unsigned int flush : 1;
+    unsigned int nonseekable : 1;
+    unsigned int flock_release : 1;
+    unsigned int padding : 27;
+    uint64_t fh;
+    uint64_t lock_owner;
+};
+
+struct fuse_conn_info {
+    unsigned proto_major;
+    unsigned proto_minor;
+    unsigned async_read;
+    unsigned max_write;
+    unsigned max_readahead;
+    unsigned capable;
+    unsigned want;
+    unsigned max_background;
+    unsigned congestion_threshold;
+    unsigned reserved[23];
+};
+
+#define FUSE_CAP_SPLICE_WRITE (1 << 7)
+#define FUSE_CAP_SPLICE_MOVE (1 << 8)
+#define FUSE_CAP_SPLICE_READ (1 << 9)
+
+typedef int (*fuse_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+enum fuse_buf_flags {
+    FUSE_BUF_IS_FD = (1 << 1),
+    FUSE_BUF_FD_SEEK = (1 << 2),
+    FUSE_BUF_FD_RETRY = (1 << 3),
+};
+
+enum fuse_buf_copy_flags {
+    FUSE_BUF_NO_SPLICE = (1 << 1),
+    FUSE_BUF_FORCE_SPLICE = (1 << 2),
+    FUSE_BUF_SPLICE_MOVE = (1 << 3),
+    FUSE_BUF_SPLICE_NONBLOCK = (1 << 4),
+};
+
+struct fuse_buf {
+    size_t size;
+    enum fuse_buf_flags flags;
+    void *mem;
+    int fd;
+    off_t pos;
+};
+
+struct fuse_bufvec {
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fuse_buf buf[1];
+};
+
+#define FUSE_BUFVEC_INIT(size__) \
+    ((struct fuse_bufvec) { 1, 0, 0, { { (size__), (enum fuse_buf_flags) 0, NULL, -1, 0 } } })
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv);
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags);
+
+struct fuse_pollhandle;
+struct flock;
+
+struct fuse_operations {
+    int (*getattr)(const char *, struct stat *);
+    int (*readlink)(const char *, char *, size_t);
+    int (*getdir)(const char *, void *, void *);
+    int (*mknod)(const char *, mode_t, dev_t);
+    int (*mkdir)(const char *, mode_t);
+    int (*unlink)(const char *);
+    int (*rmdir)(const char *);
+    int (*symlink)(const char *, const char *);
+    int (*rename)(const char *, const char *);
+    int (*link)(const char *, const char *);
+    int (*chmod)(const char *, mode_t);
+    int (*chown)(const char *, uid_t, gid_t);
+    int (*truncate)(const char *, off_t);
+    int (*utime)(const char *, struct utimbuf *);
+    int (*open)(const char *, struct fuse_file_info *);
+    int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *);
+    int (*write)(const char *, const char *, size_t, off_t, struct fuse_file_info *);
+    int (*statfs)(const char *, struct statvfs *);
+    int (*flush)(const char *, struct fuse_file_info *);
+    int (*release)(const char *, struct fuse_file_info *);
+    int (*fsync)(const char *, int, struct fuse_file_info *);
+    int (*setxattr)(const char *, const char *, const char *, size_t, int);
+    int (*getxattr)(const char *, const char *, char *, size_t);
+    int (*listxattr)(const char *, char *, size_t);
+    int (*removexattr)(const char *, const char *);
+    int (*opendir)(const char *, struct fuse_file_info *);
+    int (*readdir)(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
+    int (*releasedir)(const char *, struct fuse_file_info *);
+    int (*fsyncdir)(const char *, int, struct fuse_file_info *);
+    void *(*init)(struct fuse_conn_info *conn);
+    void (*destroy)(void *);
+    int (*access)(const char *, int);
+    int (*create)(const char *, mode_t, struct fuse_file_info *);
+    int (*ftruncate)(const char *, off_t, struct fuse_file_info *);
+    int (*fgetattr)(const char *, struct stat *, struct fuse_file_info *);
+    int (*lock)(const char *, struct fuse_file_info *, int cmd, struct flock *);
+    int (*utimens)(const char *, const struct timespec tv[2]);
+    int (*bmap)(const char *, size_t blocksize, uint64_t *idx);
+    unsigned int flag_nullpath_ok : 1;
+    unsigned int flag_nopath : 1;
+    unsigned int flag_utime_omit_ok : 1;
+    unsigned int flag_reserved : 29;
+    int (*ioctl)(const char *, int cmd, void *arg, struct fuse_file_info *, unsigned int flags, void *data);
+    int (*poll)(const char *, struct fuse_file_info *, struct fuse_pollhandle *, unsigned *reventsp);
+    int (*write_buf)(const char *, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *);
+    int (*read_buf)(const char *, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *);
+    int (*flock)(const char *, struct fuse_file_info *, int op);
+    int (*fallocate)(const char *, int, off_t, off_t, struct fuse_file_info *);
+};
+
+struct fuse_args {
+    int argc;
+    char **argv;
+    int allocated;
+};
+
+#define FUSE_ARGS_INIT(argc, argv) { argc, argv, 0 }
+
+struct fuse_opt {
+    const char *templ;
+    unsigned long offset;
+    int value;
+};
+
+#define FUSE_OPT_END { NULL, 0, 0 }
+
+typedef int (*fuse_opt_proc_t)(void *data, const char *arg, int key, struct fuse_args *outargs);
+
+int fuse_opt_parse(struct fuse_args *args, void *data, const struct fuse_opt opts[], fuse_opt_proc_t proc);
+void fuse_opt_free_args(struct fuse_args *args);
+
+int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op, size_t op_size, void *user_data);
+#define fuse_main(argc, argv, op, user_data) fuse_main_real(argc, argv, op, sizeof(*(op)), user_data)
+
+#endif
@@ -0,0 +1,560 @@
+/*
+ * Runs the cs1550 operations against a volume without mounting it.
+ *
+ * usage: harness [-r] [-o options]
+ *
+ * Built from cs1550.c with tests/fuse in front of the include path, in place
+ * of libfuse. main() in cs1550.c parses -o and opens the images as usual,
+ * then hands its operations to fuse_main, which here runs the checks below
+ * in the current directory's volume instead of serving /dev/fuse. Exits 0
+ * if every check passed; fsck can look the volume over afterwards.
+ *
+ * A run also leaves statfs's answer in statfs.out. -r mounts the volume
+ * again as it is, without adding the test directories, and checks that the
+ * answer from the clean superblock the last unmount left matches.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../cs1550.h"
+
+static int failures = 0;
+static int remount = 0;
+static int compressing = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int seedVolume(const char *images, unsigned int stripe);
+
+//cs1550.c's, run here by hand rather than from the -o defrag thread
+int defragmentStep(void);
+
+/*
+ * The bits of libfuse the filesystem calls
+ */
+
+//Fills in the options from every -o name[=value],... in args. This is the
+//last call before main() opens the volume, so it's also where the volume
+//gets the directories the checks need.
+int fuse_opt_parse(struct fuse_args *args, void *data, const struct fuse_opt opts[], fuse_opt_proc_t proc) {
+    (void) proc;
+    const char *images = NULL;
+    unsigned int stripe = 0;
+    int i, o;
+    for (i = 1; i < args->argc; i++) {
+        if (!strcmp(args->argv[i], "-r")) {
+            remount = 1;
+            continue;
+        }
+        if (strcmp(args->argv[i], "-o") || i + 1 == args->argc) {
+            fprintf(stderr, "usage: %s [-r] [-o options]\n", args->argv[0]);
+            return -1;
+        }
+        char *list = strdup(args->argv[++i]);
+        char *option, *rest = list;
+        while ((option = strsep(&rest, ","))) {
+            for (o = 0; opts[o].templ; o++) {
+                const char *equals = strchr(opts[o].templ, '=');
+                size_t name = equals ? (size_t) (equals - opts[o].templ + 1) : strlen(opts[o].templ) + 1;
+                char *field = (char *) data + opts[o].offset;
+                if (!equals && !strcmp(option, opts[o].templ)) {
+                    *(int *) field = opts[o].value;
+                    if (!strcmp(opts[o].templ, "compress")) {
+                        compressing = 1;
+                    }
+                    break;
+                } else if (equals && !strncmp(option, opts[o].templ, name)) {
+                    if (!strcmp(equals, "=%u")) {
+                        *(unsigned int *) field = strtoul(option + name, NULL, 10);
+                    } else {
+                        *(char **) field = strdup(option + name);
+                    }
+                    if (!strcmp(opts[o].templ, "images=%s")) {
+                        images = *(char **) field;
+                    } else if (!strcmp(opts[o].templ, "stripe=%u")) {
+                        stripe = *(unsigned int *) field;
+                    }
+                    break;
+                }
+            }
+            if (!opts[o].templ) {
+                fprintf(stderr, "%s: unknown option %s\n", args->argv[0], option);
+                free(list);
+                return -1;
+            }
+        }
+        free(list);
+    }
+    return remount ? 0 : seedVolume(images, stripe);
+}
+
+void fuse_opt_free_args(struct fuse_args *args) {
+    (void) args;
+}
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv) {
+    size_t i, size = 0;
+    for (i = bufv->idx; i < bufv->count; i++) {
+        size += bufv->buf[i].size;
+    }
+    return size - bufv->off;
+}
+
+//moves size bytes out of or into one piece, at off within it
+static ssize_t pieceIO(const struct fuse_buf *buf, size_t off, char *data, size_t size, int write) {
+    if (!(buf->flags & FUSE_BUF_IS_FD)) {
+        if (write) {
+            memcpy((char *) buf->mem + off, data, size);
+        } else {
+            memcpy(data, (char *) buf->mem + off, size);
+        }
+        return size;
+    }
+    return write ? pwrite(buf->fd, data, size, buf->pos + off) : pread(buf->fd, data, size, buf->pos + off);
+}
+
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags) {
+    (void) flags;
+    char bounce[65536];
+    ssize_t copied = 0;
+    while (dst->idx < dst->count && src->idx < src->count) {
+        const struct fuse_buf *to = &dst->buf[dst->idx];
+        const struct fuse_buf *from = &src->buf[src->idx];
+        size_t size = to->size - dst->off;
+        if (size > from->size - src->off) {
+            size = from->size - src->off;
+        }
+        if (size > sizeof(bounce)) {
+            size = sizeof(bounce);
+        }
+        if (pieceIO(from, src->off, bounce, size, 0) != (ssize_t) size ||
+            pieceIO(to, dst->off, bounce, size, 1) != (ssize_t) size) {
+            return copied ? copied : -EIO;
+        }
+        copied += size;
+        dst->off += size;
+        src->off += size;
+        if (dst->off == to->size) {
+            dst->idx++;
+            dst->off = 0;
+        }
+        if (src->off == from->size) {
+            src->idx++;
+            src->off = 0;
+        }
+    }
+    return copied;
+}
+
+/*
+ * Checks. Every file is a .txt: mknod's duplicate check takes any two names
+ * that differ in both name and extension for the same file.
+ */
+
+static void fill(char *data, size_t size, int seed) {
+    size_t i;
+    for (i = 0; i < size; i++) {
+        data[i] = (char) (i * 31 + seed);
+    }
+}
+
+//reads a whole file of size bytes and compares it with expected
+static int matches(const struct fuse_operations *op, const char *path, const char *expected, size_t size) {
+    char *data = malloc(size + 1);
+    int res = op->read(path, data, size + 1, 0, NULL);
+    int same = res == (int) size && !memcmp(data, expected, size);
+    free(data);
+    return same;
+}
+
+static long freeBlocks(const struct fuse_operations *op) {
+    struct statvfs st;
+    return op->statfs("/", &st) ? -1 : (long) st.f_bfree;
+}
+
+static int control(const struct fuse_operations *op, const char *path, int cmd, const char *name) {
+    struct cs1550_ioctl_name request;
+    memset(&request, 0, sizeof(struct cs1550_ioctl_name));
+    strcpy(request.name, name);
+    return op->ioctl(path, cmd, NULL, NULL, 0, &request);
+}
+
+//writes through write_buf from memory, as libfuse does without splice
+static int writeBuf(const struct fuse_operations *op, const char *path, const char *data, size_t size,
+                    off_t offset) {
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].mem = (void *) data;
+    return op->write_buf(path, &buf, offset, NULL);
+}
+
+static void checkReadWrite(const struct fuse_operations *op) {
+    static char data[40000], patch[700];
+    fill(data, sizeof(data), 1);
+    fill(patch, sizeof(patch), 2);
+    CHECK(op->mknod("/d/big.txt", 0, 0) == 0);
+    CHECK(op->write("/d/big.txt", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+    CHECK(matches(op, "/d/big.txt", data, sizeof(data)));
+    CHECK(op->write("/d/big.txt", patch, sizeof(patch), 1000, NULL) == (int) sizeof(patch));
+    memcpy(data + 1000, patch, sizeof(patch));
+    CHECK(matches(op, "/d/big.txt", data, sizeof(data)));
+    CHECK(op->mknod("/e/small.txt", 0, 0) == 0);
+    CHECK(op->write("/e/small.txt", patch, sizeof(patch), 0, NULL) == (int) sizeof(patch));
+    CHECK(matches(op, "/e/small.txt", patch, sizeof(patch)));
+    CHECK(op->read("/d/none.txt", data, 10, 0, NULL) == -ENOENT);
+}
+
+static void checkSparse(const struct fuse_operations *op) {
+    static char expected[5100], data[100];
+    fill(data, sizeof(data), 3);
+    memset(expected, 0, sizeof(expected));
+    memcpy(expected + 5000, data, sizeof(data));
+    CHECK(op->mknod("/d/sparse.txt", 0, 0) == 0);
+    CHECK(op->write("/d/sparse.txt", data, sizeof(data), 5000, NULL) == (int) sizeof(data));
+    CHECK(matches(op, "/d/sparse.txt", expected, sizeof(expected)));
+
+    long before = freeBlocks(op);
+    memset(expected, 0, sizeof(expected));
+    CHECK(op->mknod("/d/pre.txt", 0, 0) == 0);
+    CHECK(op->fallocate("/d/pre.txt", 0, 0, 3000, NULL) == 0);
+    CHECK(freeBlocks(op) == before - 6);
+    CHECK(matches(op, "/d/pre.txt", expected, 3000));
+    //past what the FAT can chain, with the block count overflowing an int
+    CHECK(op->fallocate("/d/pre.txt", 0, 0, 1LL << 40, NULL) == -EFBIG);
+    CHECK(op->fallocate("/d/pre.txt", 0, 1LL << 40, 1, NULL) == -EFBIG);
+    CHECK(freeBlocks(op) == before - 6);
+    CHECK(matches(op, "/d/pre.txt", expected, 3000));
+}
+
+static void checkBuffers(const struct fuse_operations *op) {
+    static char data[3900], other[1536], grown[2536];
+    fill(data, sizeof(data), 4);
+    fill(other, sizeof(other), 6);
+    CHECK(op->mknod("/d/buf.txt", 0, 0) == 0);
+    if (!op->write_buf) {
+        CHECK(op->write("/d/buf.txt", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+        CHECK(matches(op, "/d/buf.txt", data, sizeof(data)));
+        return;
+    }
+    CHECK(writeBuf(op, "/d/buf.txt", data, 3000, 0) == 3000);
+    //grows the file by a partial block, a whole one and another partial one
+    CHECK(writeBuf(op, "/d/buf.txt", data + 2900, 1000, 2900) == 1000);
+    CHECK(matches(op, "/d/buf.txt", data, sizeof(data)));
+    CHECK(writeBuf(op, "/d/buf.txt", data, 10, 1LL << 40) == -EFBIG);
+
+    //write_buf on a one-block clone copies that block and grows the copy by
+    //two, then an append grows it by two more, leaving the source alone
+    CHECK(op->mknod("/d/g.txt", 0, 0) == 0);
+    CHECK(op->write("/d/g.txt", data, 100, 0, NULL) == 100);
+    CHECK(control(op, "/d/g.txt", CS1550_IOC_CLONE, "/d/h.txt") == 0);
+    long before = freeBlocks(op);
+    CHECK(writeBuf(op, "/d/h.txt", other, 1536, 0) == 1536);
+    CHECK(writeBuf(op, "/d/h.txt", data, 1000, 1536) == 1000);
+    CHECK(freeBlocks(op) == before - 5);
+    CHECK(matches(op, "/d/g.txt", data, 100));
+    memcpy(grown, other, 1536);
+    memcpy(grown + 1536, data, 1000);
+    CHECK(matches(op, "/d/h.txt", grown, 2536));
+}
+
+static void checkClones(const struct fuse_operations *op) {
+    static char data[3000], other[3000], out[3000];
+    fill(data, sizeof(data), 5);
+    fill(other, sizeof(other), 6);
+    CHECK(op->mknod("/d/a.txt", 0, 0) == 0);
+    CHECK(op->write("/d/a.txt", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+
+    long before = freeBlocks(op);
+    CHECK(control(op, "/d/a.txt", CS1550_IOC_CLONE, "/d/b.txt") == 0);
+    CHECK(control(op, "/d/a.txt", CS1550_IOC_CLONE, "/d/b.txt") == -EEXIST);
+    CHECK(freeBlocks(op) == before);
+    CHECK(matches(op, "/d/b.txt", data, sizeof(data)));
+    //writing the clone's second block copies the first two, the rest stays shared
+    CHECK(op->write("/d/b.txt", other, 100, 600, NULL) == 100);
+    CHECK(freeBlocks(op) == before - 2);
+    CHECK(matches(op, "/d/a.txt", data, sizeof(data)));
+    memcpy(out, data, sizeof(out));
+    memcpy(out + 600, other, 100);
+    CHECK(matches(op, "/d/b.txt", out, sizeof(out)));
+
+    CHECK(control(op, "/", CS1550_IOC_SNAPSHOT, "s1") == 0);
+    CHECK(op->write("/d/a.txt", other, sizeof(other), 0, NULL) == (int) sizeof(other));
+    CHECK(matches(op, "/.snap/s1/d/a.txt", data, sizeof(data)));
+    CHECK(matches(op, "/d/a.txt", other, sizeof(other)));
+    CHECK(op->write("/.snap/s1/d/a.txt", other, 10, 0, NULL) == -EROFS);
+    struct stat st;
+    CHECK(op->getattr("/.snap/s1", &st) == 0 && S_ISDIR(st.st_mode));
+    //restoring from the snapshot is a clone out of it
+    CHECK(control(op, "/.snap/s1/d/a.txt", CS1550_IOC_CLONE, "/d/c.txt") == 0);
+    CHECK(matches(op, "/d/c.txt", data, sizeof(data)));
+    CHECK(control(op, "/", CS1550_IOC_DROP_SNAPSHOT, "s1") == 0);
+    CHECK(op->getattr("/.snap/s1", &st) == -ENOENT);
+    CHECK(matches(op, "/d/c.txt", data, sizeof(data)));
+}
+
+static void checkRename(const struct fuse_operations *op) {
+    static char data[2000];
+    struct stat st;
+    fill(data, sizeof(data), 7);
+    CHECK(op->mknod("/d/r.txt", 0, 0) == 0);
+    CHECK(op->write("/d/r.txt", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+    long before = freeBlocks(op);
+    CHECK(op->rename("/d/r.txt", "/d/s.txt") == 0);
+    CHECK(freeBlocks(op) == before);
+    CHECK(matches(op, "/d/s.txt", data, sizeof(data)));
+    CHECK(op->getattr("/d/s.txt", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t) sizeof(data));
+    CHECK(op->getattr("/d/r.txt", &st) == -ENOENT);
+    CHECK(op->read("/d/r.txt", data, 1, 0, NULL) == -ENOENT);
+    CHECK(op->rename("/d/s.txt", "/e/s.txt") == 0);
+    CHECK(matches(op, "/e/s.txt", data, sizeof(data)));
+    CHECK(op->getattr("/e/s.txt", &st) == 0 && S_ISREG(st.st_mode));
+    CHECK(op->getattr("/d/s.txt", &st) == -ENOENT);
+    //replacing sparse.txt frees its 10 blocks
+    before = freeBlocks(op);
+    CHECK(op->rename("/e/s.txt", "/d/sparse.txt") == 0);
+    CHECK(freeBlocks(op) == before + 10);
+    CHECK(matches(op, "/d/sparse.txt", data, sizeof(data)));
+    CHECK(op->getattr("/d/sparse.txt", &st) == 0 && st.st_size == (off_t) sizeof(data));
+    CHECK(op->rename("/e", "/f") == 0);
+    CHECK(op->getattr("/f", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(op->getattr("/e", &st) == -ENOENT);
+    CHECK(op->rename("/f", "/d") == -ENOTEMPTY);
+    CHECK(op->rename("/d/pre.txt", "/.snap/x/d/pre.txt") == -EROFS);
+}
+
+static void checkCompression(const struct fuse_operations *op) {
+    static char data[3000];
+    char report[256];
+    int blocks = -1, holes = -1, compressed = -1, ratio = -1;
+    fill(data, sizeof(data), 1);
+    CHECK(op->mknod("/d/packed.txt", 0, 0) == 0);
+    CHECK(op->write("/d/packed.txt", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+    CHECK(matches(op, "/d/packed.txt", data, sizeof(data)));
+    int length = op->getxattr("/d/packed.txt", "user.cs1550.compression", report, sizeof(report) - 1);
+    CHECK(length > 0);
+    report[length > 0 ? length : 0] = '\0';
+    CHECK(sscanf(report, "blocks=%d holes=%d compressed=%d logical=%*d stored=%*d ratio=%d%%",
+                 &blocks, &holes, &compressed, &ratio) == 4);
+    CHECK(blocks == 6 && holes == 0);
+    //every block of the fill pattern packs, to 58% of its size overall
+    if (compressing) {
+        CHECK(compressed == 6 && ratio == 58);
+    } else {
+        CHECK(compressed == 0 && ratio == 100);
+    }
+}
+
+//the fragmentation score user.cs1550.fragmentation reports for path
+static int fragmentation(const struct fuse_operations *op, const char *path) {
+    char report[256];
+    int score = -1;
+    int length = op->getxattr(path, "user.cs1550.fragmentation", report, sizeof(report) - 1);
+    if (length > 0) {
+        report[length] = '\0';
+        sscanf(report, "blocks=%*d fragments=%*d score=%d%%", &score);
+    }
+    return score;
+}
+
+static void checkDefrag(const struct fuse_operations *op) {
+    static char one[3072], two[3072];
+    fill(one, sizeof(one), 8);
+    fill(two, sizeof(two), 9);
+    CHECK(op->mknod("/d/f1.txt", 0, 0) == 0);
+    CHECK(op->mknod("/d/f2.txt", 0, 0) == 0);
+    //appending a block to each in turn interleaves their chains
+    off_t offset;
+    for (offset = 0; offset < (off_t) sizeof(one); offset += BLOCK_SIZE) {
+        CHECK(op->write("/d/f1.txt", one + offset, BLOCK_SIZE, offset, NULL) == BLOCK_SIZE);
+        CHECK(op->write("/d/f2.txt", two + offset, BLOCK_SIZE, offset, NULL) == BLOCK_SIZE);
+    }
+    CHECK(fragmentation(op, "/d/f1.txt") == 100);
+    CHECK(fragmentation(op, "/d/f2.txt") == 100);
+    long before = freeBlocks(op);
+    int steps = 0;
+    while (defragmentStep() > 0 && steps < 10) {
+        steps++;
+    }
+    CHECK(steps > 0);
+    CHECK(fragmentation(op, "/d/f1.txt") == 0);
+    CHECK(fragmentation(op, "/d/f2.txt") == 0);
+    CHECK(freeBlocks(op) == before);
+    CHECK(matches(op, "/d/f1.txt", one, sizeof(one)));
+    CHECK(matches(op, "/d/f2.txt", two, sizeof(two)));
+}
+
+//the arena and block pool sizes from the user.cs1550.memory report
+static int memoryUse(const struct fuse_operations *op, long *arena_bytes, long *pool_blocks) {
+    char report[256];
+    int length = op->getxattr("/", "user.cs1550.memory", report, sizeof(report) - 1);
+    if (length <= 0) {
+        return -1;
+    }
+    report[length] = '\0';
+    return sscanf(report, "threads=%*d arena_bytes=%ld pool_blocks=%ld", arena_bytes, pool_blocks) == 2 ? 0 : -1;
+}
+
+//a round of the requests the arena and the block pool serve
+static void memoryBatch(const struct fuse_operations *op, const char *data, char *out, size_t size) {
+    struct statvfs st;
+    struct stat attr;
+    char report[256];
+    CHECK(op->write("/d/mem.txt", data, size, 0, NULL) == (int) size);
+    CHECK(op->read("/d/mem.txt", out, size, 0, NULL) == (int) size);
+    CHECK(op->fallocate("/d/mem.txt", 0, 0, size + BLOCK_SIZE, NULL) == 0);
+    CHECK(op->getxattr("/d/mem.txt", "user.cs1550.fragmentation", report, sizeof(report)) > 0);
+    CHECK(op->statfs("/", &st) == 0);
+    CHECK(op->getattr("/d/mem.txt", &attr) == 0);
+}
+
+static void checkMemory(const struct fuse_operations *op) {
+    static char data[2000], out[2000];
+    long arena_bytes = -1, pool_blocks = -1, arena_after = -1, pool_after = -1;
+    int i;
+    fill(data, sizeof(data), 10);
+    CHECK(op->mknod("/d/mem.txt", 0, 0) == 0);
+    //the first round may grow the arena and fill the pool; later ones reuse them
+    memoryBatch(op, data, out, sizeof(data));
+    CHECK(memoryUse(op, &arena_bytes, &pool_blocks) == 0);
+    CHECK(arena_bytes > 0 && pool_blocks > 0);
+    for (i = 0; i < 50; i++) {
+        memoryBatch(op, data, out, sizeof(data));
+    }
+    CHECK(memoryUse(op, &arena_after, &pool_after) == 0);
+    CHECK(arena_after == arena_bytes && pool_after == pool_blocks);
+    CHECK(!memcmp(out, data, sizeof(data)));
+}
+
+#define STATFS_FILE "statfs.out"
+
+static void saveStatfs(const struct fuse_operations *op) {
+    struct statvfs st;
+    FILE *out = fopen(STATFS_FILE, "w");
+    CHECK(out && op->statfs("/", &st) == 0 && fwrite(&st, sizeof(struct statvfs), 1, out) == 1);
+    if (out) {
+        fclose(out);
+    }
+}
+
+static void checkRemount(const struct fuse_operations *op) {
+    struct statvfs saved, st;
+    FILE *in = fopen(STATFS_FILE, "r");
+    CHECK(in && fread(&saved, sizeof(struct statvfs), 1, in) == 1);
+    if (in) {
+        fclose(in);
+    }
+    CHECK(op->statfs("/", &st) == 0 && !memcmp(&st, &saved, sizeof(struct statvfs)));
+}
+
+/*
+ * mkdir doesn't work yet, so the directories the checks use go into the
+ * root by hand before mounting: /d in block 1 and /e in block 2. The
+ * superblock is marked unclean so the mount rebuilds its counts.
+ */
+static int volumeIO(int *fds, int members, int stripe, off_t pos, void *data, size_t size, int write) {
+    char *bytes = data;
+    while (size > 0) {
+        int member;
+        off_t member_pos;
+        size_t length = stripeLocate(pos, members, stripe, &member, &member_pos);
+        if (length > size) {
+            length = size;
+        }
+        ssize_t res = write ? pwrite(fds[member], bytes, length, member_pos) :
+                      pread(fds[member], bytes, length, member_pos);
+        if (res != (ssize_t) length) {
+            return -1;
+        }
+        bytes += length;
+        pos += length;
+        size -= length;
+    }
+    return 0;
+}
+
+static int seedVolume(const char *images, unsigned int stripe) {
+    char *names = strdup(images ? images : ".disk");
+    char *name, *rest = names;
+    int fds[MAX_MEMBERS];
+    int members = 0, res = -1;
+    off_t member_size = -1;
+    while ((name = strsep(&rest, ":")) && members < MAX_MEMBERS) {
+        struct stat st;
+        fds[members] = open(name, O_RDWR);
+        if (fds[members] < 0 || fstat(fds[members], &st)) {
+            perror(name);
+            free(names);
+            return -1;
+        }
+        if (member_size == -1 || st.st_size < member_size) {
+            member_size = st.st_size;
+        }
+        members++;
+    }
+    free(names);
+    stripe = stripe ? stripe : DEFAULT_STRIPE;
+    off_t size = stripedSize(member_size, members, stripe);
+
+    struct cs1550_root_directory root;
+    struct cs1550_tables tables;
+    struct cs1550_superblock super;
+    memset(&root, 0, sizeof(struct cs1550_root_directory));
+    root.nDirectories = 2;
+    strcpy(root.directories[0].dname, "d");
+    root.directories[0].nStartBlock = 1;
+    strcpy(root.directories[1].dname, "e");
+    root.directories[1].nStartBlock = 2;
+    if (!volumeIO(fds, members, stripe, size + TABLES_OFFSET, &tables, sizeof(tables), 0) &&
+        !volumeIO(fds, members, stripe, size + SUPERBLOCK_OFFSET, &super, sizeof(super), 0)) {
+        tables.fat.table[1] = (short) -2;
+        tables.fat.table[2] = (short) -2;
+        super.clean = 0;
+        res = volumeIO(fds, members, stripe, 0, &root, sizeof(root), 1) ||
+              volumeIO(fds, members, stripe, size + TABLES_OFFSET, &tables, sizeof(tables), 1) ||
+              volumeIO(fds, members, stripe, size + SUPERBLOCK_OFFSET, &super, sizeof(super), 1);
+    }
+    while (members > 0) {
+        close(fds[--members]);
+    }
+    return res;
+}
+
+/*
+ * Runs in place of the FUSE main loop
+ */
+int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op, size_t op_size, void *user_data) {
+    (void) argc;
+    (void) argv;
+    (void) op_size;
+    (void) user_data;
+    op->init(NULL);
+    if (remount) {
+        checkRemount(op);
+    } else {
+        checkReadWrite(op);
+        checkSparse(op);
+        checkBuffers(op);
+        checkClones(op);
+        checkRename(op);
+        checkCompression(op);
+        checkDefrag(op);
+        checkMemory(op);
+        saveStatfs(op);
+    }
+    op->destroy(NULL);
+    printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Builds mkfs, fsck, cs1550ctl and the mount-free harness, then for each set
+# of mount options makes a fresh volume with mkfs, runs the harness's checks
+# on it, mounts it again to see the unmount left it clean and has fsck look
+# the result over.
+#
+# usage: tests/run.sh    (from anywhere; CC and CFLAGS are honoured)
+
+set -e
+cd "$(dirname "$0")/.."
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+cc="${CC:-cc} ${CFLAGS:--Wall -O2} -pthread"
+
+$cc -o "$out/mkfs" mkfs.c
+$cc -o "$out/fsck" fsck.c
+$cc -o "$out/cs1550ctl" cs1550ctl.c
+$cc -Itests/fuse -o "$out/harness" cs1550.c tests/harness.c
+
+failed=0
+
+# overwrites FAT entry $1 of the default .disk with the bytes in $2
+fat() {
+    printf "$2" | dd of=.disk bs=1 seek=$((10240 * 512 - 512 + 2 * $1)) conv=notrunc 2>/dev/null
+}
+
+# name, mkfs arguments, mount options, fsck arguments
+check() {
+    rm -f "$out"/*.img "$out"/*.log "$out/.disk"
+    if (cd "$out" && ./mkfs $2 >/dev/null && ./harness ${3:+-o $3} >harness.log &&
+        ./harness -r ${3:+-o $3} >remount.log && ! grep -q rebuilding remount.log && ./fsck $4 >fsck.log); then
+        echo "$1: ok"
+    else
+        echo "$1: FAILED"
+        grep -v '^$' "$out/harness.log" "$out/remount.log" "$out/fsck.log" 2>/dev/null | head -20
+        failed=1
+    fi
+}
+
+check plain "" "" ""
+check compress "" "compress" ""
+check striped "-s 4 a.img b.img c.img" "images=a.img:b.img:c.img,stripe=4" "-s 4 a.img b.img c.img"
+check direct "" "direct,cache=8" ""
+check "striped direct" "-s 16 a.img b.img" "images=a.img:b.img,stripe=16,direct" "-s 16 a.img b.img"
+
+# a block the FAT has in use that nothing owns: fsck finds it, -y frees it
+rm -f "$out/.disk"
+if (cd "$out" && ./mkfs >/dev/null && fat 200 '\376\377' &&
+    { ./fsck >/dev/null; [ $? -eq 4 ]; } && { ./fsck -y >/dev/null; [ $? -eq 1 ]; } && ./fsck >/dev/null); then
+    echo "fsck repair: ok"
+else
+    echo "fsck repair: FAILED"
+    failed=1
+fi
+
+# name, FAT entry and the bytes to put in it, what fsck has to say. Starts
+# from the plain harness's volume: /d/big.txt in blocks 3-81, /e/small.txt
+# in 82-83.
+corrupt() {
+    rm -f "$out/.disk"
+    if (cd "$out" && ./mkfs >/dev/null && ./harness >/dev/null && fat $2 "$3" &&
+        { ./fsck >fsck.log; [ $? -eq 4 ]; } && grep -q "$4" fsck.log); then
+        echo "$1: ok"
+    else
+        echo "$1: FAILED"
+        head -5 "$out/fsck.log"
+        failed=1
+    fi
+}
+
+corrupt "fsck loop" 10 '\005\000' "big.txt: chain loops back to block 5"
+corrupt "fsck cross-link" 82 '\004\000' "block 4 is cross-linked"
+
+exit $failed